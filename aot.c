@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include "engine.h"
+#include "aot.h"
+#include "stats.h"
+
+#define AOT_VERSION 1
+
+static unsigned long long hashStep(unsigned long long hash, unsigned long long value)
+{
+    int i;
+    for (i = 0; i < 8; ++i, value >>= 8)
+        hash = (hash ^ (value & 0xFF)) * 1099511628211ULL;
+    return hash;
+}
+
+static unsigned long long hashLayout(struct Code * code)
+{
+    unsigned long long hash = 1469598103934665603ULL;
+
+    hash = hashStep(hash, AOT_VERSION);
+    hash = hashStep(hash, sizeof(word_t));
+    hash = hashStep(hash, code->word_bits);
+    hash = hashStep(hash, code->saturate);
+    hash = hashStep(hash, code->mem_start);
+    hash = hashStep(hash, code->length);
+    hash = hashStep(hash, code->mem_cnt);
+
+    int i;
+    for (i = 0; i < code->length; ++i)
+        hash = hashStep(hash, (unsigned long long)encodeCommand(code->rows[i]));
+    for (i = 0; i < code->mem_cnt; ++i)
+        hash = hashStep(hash, code->mem_ptrs[i]);
+    return hash;
+}
+
+static void cacheDir(char * dir, int size)
+{
+    const char * env = getenv("UM3_AOT_CACHE");
+    if (env && env[0])
+    {
+        snprintf(dir, size, "%s", env);
+        mkdir(dir, 0755);
+        return;
+    }
+
+    char base[800];
+    if ((env = getenv("XDG_CACHE_HOME")) && env[0])
+        snprintf(base, sizeof(base), "%s", env);
+    else if ((env = getenv("HOME")) && env[0])
+        snprintf(base, sizeof(base), "%s/.cache", env);
+    else snprintf(base, sizeof(base), "/tmp");
+
+    mkdir(base, 0755);
+    snprintf(dir, size, "%s/um3-aot", base);
+    mkdir(dir, 0755);
+}
+
+static const char * operandOp(int key)
+{
+    switch (key)
+    {
+        case 0x01: return "addWord";
+        case 0x02: return "subWord";
+        case 0x03:
+        case 0x13: return "mulWord";
+    }
+    return NULL;
+}
+
+static const char * compareOp(int key)
+{
+    switch (key)
+    {
+        case 0x81: return "==";
+        case 0x82: return "!=";
+        case 0x83:
+        case 0x93: return "<";
+        case 0x84:
+        case 0x94: return ">=";
+        case 0x85:
+        case 0x95: return ">";
+        case 0x86:
+        case 0x96: return "<=";
+    }
+    return NULL;
+}
+
+static void emitJump(FILE * out, struct Code * code, int target)
+{
+    int row = findCommandKey(code, target);
+    if (row >= 0)
+        fprintf(out, "goto R%d;", row);
+    else fprintf(out, "FAIL(%d, %d, 0);", row == -1 ? STEP_NO_COMMAND : STEP_TERMINATED, target);
+}
+
+static void emitPrelude(FILE * out, struct Code * code)
+{
+#ifdef UM3_WIDE_WORDS
+    fprintf(out, "typedef __int128 word_t;\ntypedef unsigned __int128 uword_t;\n");
+#else
+    fprintf(out, "typedef long long word_t;\ntypedef unsigned long long uword_t;\n");
+#endif
+    fprintf(out, "#define BITS %d\n#define FULL %d\n#define SAT %d\n", code->word_bits, WORD_MAX_BITS, code->saturate);
+    fprintf(out,
+        "#define WMAX ((word_t)(((uword_t)1 << (BITS - 1)) - 1))\n"
+        "#define WMIN (-WMAX - 1)\n"
+        "static inline word_t wrapWord(word_t v) { return BITS == FULL ? v : (word_t)((uword_t)v << (FULL - BITS)) >> (FULL - BITS); }\n"
+        "static inline word_t clampWord(word_t v) { return BITS == FULL ? v : v > WMAX ? WMAX : v < WMIN ? WMIN : v; }\n"
+        "static inline word_t addWord(word_t a, word_t b) { word_t r; if (!SAT) return wrapWord((word_t)((uword_t)a + (uword_t)b));"
+        " if (__builtin_add_overflow(a, b, &r)) return b < 0 ? WMIN : WMAX; return clampWord(r); }\n"
+        "static inline word_t subWord(word_t a, word_t b) { word_t r; if (!SAT) return wrapWord((word_t)((uword_t)a - (uword_t)b));"
+        " if (__builtin_sub_overflow(a, b, &r)) return b > 0 ? WMIN : WMAX; return clampWord(r); }\n"
+        "static inline word_t mulWord(word_t a, word_t b) { word_t r; if (!SAT) return wrapWord((word_t)((uword_t)a * (uword_t)b));"
+        " if (__builtin_mul_overflow(a, b, &r)) return (a < 0) != (b < 0) ? WMIN : WMAX; return clampWord(r); }\n"
+        "#define FAIL(kind, arg, back) do { steps -= back; fail_kind = kind; fail_arg = arg; goto fail; } while (0)\n"
+        "#define BLOCK(row, len) do { if (max_steps - steps < len) { fail_arg = row; goto limit; } steps += len; } while (0)\n\n");
+}
+
+static int isJump(int key)
+{
+    return key >= 0x80 && key <= 0x96;
+}
+
+static int generateSource(struct Code * code, const char * path)
+{
+    FILE * out = fopen(path, "w");
+    if (!out)
+    {
+        fprintf(stderr, "Couldn't open file \"%s\"\n", path);
+        return -1;
+    }
+
+    char * leader = (char*) calloc(code->length + 1, 1);
+    int  * block_end = (int*) malloc(sizeof(int) * (code->length + 1));
+    if (!leader || !block_end)
+    {
+        free(leader);
+        free(block_end);
+        fclose(out);
+        return -1;
+    }
+
+    int i;
+    leader[0] = 1;
+    for (i = 0; i < code->length; ++i)
+    {
+        int key = code->rows[i].key;
+        if (isJump(key) || key == 0x99)
+        {
+            leader[i + 1] = 1;
+            int target = findCommandKey(code, code->rows[i].arg3);
+            if (isJump(key) && target >= 0)
+                leader[target] = 1;
+        }
+    }
+
+    block_end[code->length] = code->length;
+    for (i = code->length - 1; i >= 0; --i)
+        block_end[i] = leader[i + 1] ? i + 1 : block_end[i + 1];
+
+    emitPrelude(out, code);
+
+    fprintf(out, "int um3_run(word_t * c, long long max_steps, long long * steps_out, int * err_kind, int * err_arg)\n{\n");
+    fprintf(out, "    long long steps = 0;\n    int fail_kind, fail_arg;\n    word_t d, m;\n\n");
+
+    for (i = 0; i < code->length; ++i)
+    {
+        struct Command * cmd = code->rows + i;
+        int key = cmd->key;
+        int next = code->mem_start + i + cmd->word_length;
+        int back = block_end[i] - 1 - i;
+
+        if (leader[i])
+        {
+            fprintf(out, "R%d: BLOCK(%d, %d);\n", i, i, block_end[i] - i);
+        }
+
+        fprintf(out, "    ");
+
+        if (key == 0x99)
+        {
+            fprintf(out, "goto finish;\n");
+            continue;
+        }
+
+        int s1 = -1, s2 = -1, s3 = -1;
+        int undefined = -1;
+
+        if (!isJump(key) && (s3 = code->cell_slots[cmd->arg3]) < 0)
+            undefined = cmd->arg3;
+        if (undefined < 0 && key != 0x80 && (s1 = code->cell_slots[cmd->arg1]) < 0)
+            undefined = cmd->arg1;
+        if (undefined < 0 && key != 0x80 && key != 0x00 && (s2 = code->cell_slots[cmd->arg2]) < 0)
+            undefined = cmd->arg2;
+
+        if (undefined >= 0)
+        {
+            fprintf(out, "FAIL(%d, %d, %d);\n", STEP_UNDEFINED_CELL, undefined, back);
+            continue;
+        }
+
+        if (key == 0x00)
+            fprintf(out, "c[%d] = c[%d]; ", s3, s1);
+        else if (operandOp(key))
+            fprintf(out, "c[%d] = %s(c[%d], c[%d]); ", s3, operandOp(key), s1, s2);
+        else if (key == 0x04 || key == 0x14)
+        {
+            int s4 = cmd->arg3 + 1 < MEM_SIZE ? code->cell_slots[cmd->arg3 + 1] : -1;
+
+            fprintf(out, "if (c[%d] == 0) FAIL(%d, 0, %d); ", s2, STEP_DIVIDE_BY_ZERO, back);
+            fprintf(out, "if (c[%d] == -1) { d = subWord(0, c[%d]); m = 0; } ", s2, s1);
+            fprintf(out, "else { d = c[%d] / c[%d]; m = c[%d] - c[%d] * d; } ", s1, s2, s1, s2);
+            fprintf(out, "c[%d] = d; ", s3);
+            if (s4 >= 0)
+                fprintf(out, "c[%d] = m; ", s4);
+        }
+        else if (key == 0x80)
+        {
+            emitJump(out, code, cmd->arg3);
+            fprintf(out, "\n");
+            continue;
+        }
+        else
+        {
+            fprintf(out, "if (c[%d] %s c[%d]) ", s1, compareOp(key), s2);
+            emitJump(out, code, cmd->arg3);
+            fprintf(out, " ");
+        }
+
+        if (!back)
+            emitJump(out, code, next);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\n");
+    fprintf(out, "fail:\n    *err_kind = fail_kind;\n    *err_arg = fail_arg;\n    *steps_out = steps;\n    return -1;\n");
+    fprintf(out, "finish:\n    *err_kind = %d;\n    *steps_out = steps;\n    return 1;\n", STEP_FINISHED);
+    fprintf(out, "limit:\n    *err_arg = fail_arg;\n    *steps_out = steps;\n    return 0;\n}\n");
+
+    free(leader);
+    free(block_end);
+    fclose(out);
+    return 0;
+}
+
+static int compileSource(const char * src, const char * so)
+{
+    const char * cc = getenv("CC");
+    if (!cc || !cc[0])
+        cc = "cc";
+
+    char tmp[1100], cmd[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", so, (int)getpid()) >= (int)sizeof(tmp) ||
+        snprintf(cmd, sizeof(cmd), "%s -O2 -shared -fPIC -w -o '%s' '%s'", cc, tmp, src) >= (int)sizeof(cmd))
+    {
+        fprintf(stderr, "Path is too long: \"%s\"\n", so);
+        return -1;
+    }
+
+    if (system(cmd))
+    {
+        fprintf(stderr, "Couldn't compile \"%s\"\n", src);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (rename(tmp, so))
+    {
+        fprintf(stderr, "Couldn't store \"%s\"\n", so);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+struct AotProgram * aotLoad(struct Code * code)
+{
+    if (code->unified)
+    {
+        fprintf(stderr, "Self-modifying (unified) programs can't be compiled ahead of time\n");
+        return NULL;
+    }
+
+    char dir[1024], src[1100], so[1100];
+    cacheDir(dir, sizeof(dir));
+
+    unsigned long long hash = hashLayout(code);
+    snprintf(src, sizeof(src), "%s/%016llx.XXXXXX.c", dir, hash);
+    snprintf(so,  sizeof(so),  "%s/%016llx.so", dir, hash);
+
+    if (access(so, R_OK))
+    {
+        int fd = mkstemps(src, 2);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Couldn't create \"%s\"\n", src);
+            return NULL;
+        }
+        close(fd);
+
+        int status = generateSource(code, src) || compileSource(src, so);
+        unlink(src);
+        if (status)
+            return NULL;
+    }
+
+    void * handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        fprintf(stderr, "Couldn't load \"%s\": %s\n", so, dlerror());
+        return NULL;
+    }
+
+    struct AotProgram * prog = (struct AotProgram*) malloc(sizeof(struct AotProgram));
+    if (!prog)
+    {
+        dlclose(handle);
+        return NULL;
+    }
+
+    prog->handle = handle;
+    prog->run    = (AotFunc) dlsym(handle, "um3_run");
+    if (!prog->run)
+    {
+        fprintf(stderr, "Invalid compiled program \"%s\"\n", so);
+        aotClose(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+long long aotRun(struct AotProgram * prog, struct Code * code, long long max_steps, int * status, char * err_str)
+{
+    long long steps = 0;
+    int err_kind = 0, err_arg = 0;
+
+    STATS_BEGIN(start);
+    PROBE_RUN_START(code->length);
+
+    *status = prog->run(code->mem_vals, max_steps, &steps, &err_kind, &err_arg);
+    if (*status)
+        stepMessage(err_str, err_kind, err_arg);
+    else
+    {
+        StepFunc step = selectStep(code);
+        int cmd_i = err_arg, cmd_ptr = code->mem_start + err_arg;
+        while (steps < max_steps)
+        {
+            steps++;
+            if ((*status = step(code, err_str, &cmd_i, &cmd_ptr)))
+                break;
+        }
+    }
+
+    if (!*status)
+    {
+        PROBE_STEP_LIMIT(steps);
+        STATS_COUNT(STAT_LIMITS, 1);
+    }
+    PROBE_RUN_FINISH(steps, *status);
+
+    STATS_END(STAT_RUN, start);
+    STATS_COUNT(STAT_STEPS, steps);
+    STATS_COUNT(STAT_RUNS, 1);
+    return steps;
+}
+
+void aotClose(struct AotProgram * prog)
+{
+    dlclose(prog->handle);
+    free(prog);
+}
@@ -0,0 +1,19 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "code.h"
+
+ typedef int (*AotFunc)(word_t * cells, long long max_steps, long long * steps, int * err_kind, int * err_arg);
+
+ struct AotProgram {
+     void * handle;
+     AotFunc run;
+ };
+
+ struct AotProgram * aotLoad(struct Code * code);
+
+ long long aotRun(struct AotProgram * prog, struct Code * code, long long max_steps, int * status, char * err_str);
+
+ void aotClose(struct AotProgram * prog);
+
+#endif
@@ -0,0 +1,462 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "engine.h"
+#include "aot.h"
+#include "bench.h"
+
+#define BENCH_REPS     3
+#define BENCH_SEED     0x5EED1234u
+#define TRACE_BUDGET   (256LL << 20)
+#define CELLS_START    0x8000
+
+struct BenchResult {
+    char workload[32];
+    char engine[32];
+    long long steps;
+    double ns_per_step;
+    double steps_per_sec;
+    long peak_rss_kb;
+    double allocs_per_step;
+};
+
+struct Workload {
+    const char * name;
+    void (*generate)(FILE * stream);
+};
+
+struct Engine {
+    const char * name;
+    int flags;
+    int traced;
+    int generic;
+    int aot;
+};
+
+static unsigned int bench_rand_state;
+
+static unsigned int benchRand()
+{
+    bench_rand_state = bench_rand_state * 1103515245u + 12345u;
+    return bench_rand_state >> 8;
+}
+
+static void genLoop(FILE * stream)
+{
+    const int i = CELLS_START, j = i + 1, acc = i + 2, one = i + 3, zero = i + 4, n1 = i + 5, n2 = i + 6;
+
+    fprintf(stream, "0000\n\n");
+    fprintf(stream, "%04X = 0\n%04X = 0\n%04X = 0\n%04X = 1\n%04X = 0\n%04X = 1000\n%04X = 1000\n\n",
+        i, j, acc, one, zero, n1, n2);
+
+    fprintf(stream, "00 %04X 0000 %04X\n", n1, i);
+    fprintf(stream, "00 %04X 0000 %04X\n", n2, j);
+    fprintf(stream, "01 %04X %04X %04X\n", acc, j, acc);
+    fprintf(stream, "02 %04X %04X %04X\n", j, one, j);
+    fprintf(stream, "82 %04X %04X 0002\n", j, zero);
+    fprintf(stream, "02 %04X %04X %04X\n", i, one, i);
+    fprintf(stream, "82 %04X %04X 0001\n", i, zero);
+    fprintf(stream, "99 0000 0000 0000\n");
+}
+
+static void genWide(FILE * stream)
+{
+    const int cells = 4096, body = 512;
+    const int n = CELLS_START + cells, one = n + 1, zero = n + 2;
+
+    fprintf(stream, "0000\n\n");
+
+    int k;
+    for (k = 0; k < cells; ++k)
+        fprintf(stream, "%04X = %d\n", CELLS_START + k, k);
+    fprintf(stream, "%04X = 2000\n%04X = 1\n%04X = 0\n\n", n, one, zero);
+
+    for (k = 0; k < body; ++k)
+    {
+        int a = CELLS_START + (k * 8) % cells;
+        int b = CELLS_START + (k * 8 + 4097) % cells;
+        fprintf(stream, "01 %04X %04X %04X\n", a, b, a);
+    }
+    fprintf(stream, "02 %04X %04X %04X\n", n, one, n);
+    fprintf(stream, "82 %04X %04X 0000\n", n, zero);
+    fprintf(stream, "99 0000 0000 0000\n");
+}
+
+static void genStraight(FILE * stream)
+{
+    const int cells = 16, body = 8192;
+    const int n = CELLS_START + cells, one = n + 1, zero = n + 2, mult = n + 3;
+
+    fprintf(stream, "0000\n\n");
+
+    int k;
+    for (k = 0; k < cells; ++k)
+        fprintf(stream, "%04X = %u\n", CELLS_START + k, benchRand() | 1);
+    fprintf(stream, "%04X = 64\n%04X = 1\n%04X = 0\n%04X = 2654435761\n\n", n, one, zero, mult);
+
+    for (k = 0; k < body; ++k)
+    {
+        int dst = CELLS_START + benchRand() % cells;
+        int src = CELLS_START + (dst - CELLS_START + 1 + benchRand() % (cells - 1)) % cells;
+
+        switch (benchRand() % 3)
+        {
+            case 0:  fprintf(stream, "01 %04X %04X %04X\n", dst, src,  dst); break;
+            case 1:  fprintf(stream, "02 %04X %04X %04X\n", dst, src,  dst); break;
+            default: fprintf(stream, "03 %04X %04X %04X\n", dst, mult, dst); break;
+        }
+    }
+    fprintf(stream, "02 %04X %04X %04X\n", n, one, n);
+    fprintf(stream, "82 %04X %04X 0000\n", n, zero);
+    fprintf(stream, "99 0000 0000 0000\n");
+}
+
+static void genJumps(FILE * stream)
+{
+    const int blocks = 1024;
+    const int n = CELLS_START, one = n + 1, zero = n + 2;
+    const int halt = blocks * 3;
+
+    int * order = (int*) malloc(sizeof(int) * blocks);
+    int * next  = (int*) malloc(sizeof(int) * blocks);
+
+    int k;
+    for (k = 0; k < blocks; ++k)
+        order[k] = k;
+    for (k = blocks - 1; k > 0; --k)
+    {
+        int r = benchRand() % (k + 1);
+        int t = order[k];
+        order[k] = order[r];
+        order[r] = t;
+    }
+    for (k = 0; k < blocks; ++k)
+        next[order[k]] = order[(k + 1) % blocks];
+
+    fprintf(stream, "0000\n\n");
+    fprintf(stream, "%04X = 1000000\n%04X = 1\n%04X = 0\n\n", n, one, zero);
+
+    for (k = 0; k < blocks; ++k)
+    {
+        fprintf(stream, "02 %04X %04X %04X\n", n, one, n);
+        fprintf(stream, "81 %04X %04X %04X\n", n, zero, halt);
+        fprintf(stream, "80 0000 0000 %04X\n", next[k] * 3);
+    }
+    fprintf(stream, "99 0000 0000 0000\n");
+
+    free(order);
+    free(next);
+}
+
+static const struct Workload workloads[] = {
+    {"loop",     genLoop},
+    {"wide",     genWide},
+    {"straight", genStraight},
+    {"jumps",    genJumps},
+};
+
+static const struct Engine engines[] = {
+    {"step",    0,            0, 0, 0},
+    {"generic", 0,            0, 1, 0},
+    {"unified", LOAD_UNIFIED, 0, 0, 0},
+    {"trace",   0,            1, 0, 0},
+    {"aot",     0,            0, 0, 1},
+};
+
+static struct Code * generateCode(const struct Workload * wl, int flags)
+{
+    char * text = NULL;
+    size_t size = 0;
+
+    FILE * stream = open_memstream(&text, &size);
+    if (!stream)
+        return NULL;
+
+    bench_rand_state = BENCH_SEED;
+    wl->generate(stream);
+    fclose(stream);
+
+    stream = fmemopen(text, size, "r");
+    struct Code * code = stream ? loadFromStream(stream, flags) : NULL;
+
+    if (stream)
+        fclose(stream);
+    free(text);
+    return code;
+}
+
+static double nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long long runTraced(struct Code * code, StepFunc step, long long max_steps)
+{
+    struct State st;
+    stateInit(&st);
+
+    int cmd_i = 0, cmd_ptr = code->mem_start;
+    long long steps = 0;
+
+    stateAddRow(&st, code, cmd_i, cmd_ptr);
+    while (steps < max_steps)
+    {
+        steps++;
+        if (step(code, st.error, &cmd_i, &cmd_ptr) || stateAddRow(&st, code, cmd_i, cmd_ptr))
+            break;
+    }
+
+    stateFree(&st);
+    return steps;
+}
+
+static int measure(const struct Workload * wl, const struct Engine * en, int word_bits, int saturate, struct BenchResult * res)
+{
+    struct Code * loaded = generateCode(wl, en->flags);
+    if (!loaded || setWordWidth(loaded, word_bits, saturate))
+        return -1;
+
+    struct AotProgram * prog = en->aot ? aotLoad(loaded) : NULL;
+    if (en->aot && !prog)
+        return -1;
+
+    long long max_steps = 1LL << 40;
+    if (en->traced)
+    {
+        max_steps = TRACE_BUDGET / ((long long)sizeof(word_t) * loaded->slot_cnt + sizeof(struct CodeRow));
+        if (max_steps > MAX_STATE_LENGTH - 2)
+            max_steps = MAX_STATE_LENGTH - 2;
+    }
+
+    strncpy(res->workload, wl->name, sizeof(res->workload) - 1);
+    strncpy(res->engine,   en->name, sizeof(res->engine)   - 1);
+
+    double best = -1;
+    long long allocs = 0;
+
+    int rep;
+    for (rep = 0; rep < BENCH_REPS; ++rep)
+    {
+        struct Code code;
+        if (codeCpy(loaded, &code))
+            return -1;
+
+        StepFunc step = en->generic ? runCommand : selectStep(&code);
+        char err_str[128];
+        int status;
+
+        long long allocs_before = engine_allocs;
+        double start = nowNs();
+
+        if (en->traced)
+            res->steps = runTraced(&code, step, max_steps);
+        else if (en->aot)
+            res->steps = aotRun(prog, &code, max_steps, &status, err_str);
+        else res->steps = runSteps(&code, step, max_steps, &status, err_str);
+
+        double elapsed = nowNs() - start;
+        allocs = engine_allocs - allocs_before;
+
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+        codeFree(&code);
+    }
+
+    if (prog)
+        aotClose(prog);
+    codeDtor(loaded);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    res->ns_per_step     = best / res->steps;
+    res->steps_per_sec   = res->steps / (best * 1e-9);
+    res->peak_rss_kb     = usage.ru_maxrss;
+    res->allocs_per_step = (double)allocs / res->steps;
+    return 0;
+}
+
+static int measureIsolated(const struct Workload * wl, const struct Engine * en, int word_bits, int saturate, struct BenchResult * res)
+{
+    int fds[2];
+    if (pipe(fds))
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        int status = measure(wl, en, word_bits, saturate, res);
+        if (!status && write(fds[1], res, sizeof(*res)) != sizeof(*res))
+            status = -1;
+        _exit(status ? 1 : 0);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    if (got != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+    return 0;
+}
+
+int runBench(const char * out_path, int word_bits, int saturate)
+{
+    FILE * out = NULL;
+    if (out_path)
+    {
+        out = fopen(out_path, "w");
+        if (!out)
+        {
+            fprintf(stderr, "Couldn't open file \"%s\"\n", out_path);
+            return -1;
+        }
+        fprintf(out, "# workload\tengine\tsteps\tns_per_step\tsteps_per_sec\tpeak_rss_kb\tallocs_per_step\n");
+    }
+
+    printf("%-10s %-8s %12s %10s %14s %12s %12s\n",
+        "workload", "engine", "steps", "ns/step", "steps/sec", "peak RSS KB", "allocs/step");
+
+    int failed = 0;
+
+    int w, e;
+    for (w = 0; w < (int)(sizeof(workloads) / sizeof(workloads[0])); ++w)
+    {
+        for (e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); ++e)
+        {
+            struct BenchResult res;
+            memset(&res, 0, sizeof(res));
+
+            if (measureIsolated(workloads + w, engines + e, word_bits, saturate, &res))
+            {
+                fprintf(stderr, "Benchmark %s/%s failed\n", workloads[w].name, engines[e].name);
+                failed = 1;
+                continue;
+            }
+
+            printf("%-10s %-8s %12lld %10.2f %14.0f %12ld %12.4f\n",
+                res.workload, res.engine, res.steps, res.ns_per_step,
+                res.steps_per_sec, res.peak_rss_kb, res.allocs_per_step);
+            fflush(stdout);
+
+            if (out)
+                fprintf(out, "%s\t%s\t%lld\t%.3f\t%.0f\t%ld\t%.6f\n",
+                    res.workload, res.engine, res.steps, res.ns_per_step,
+                    res.steps_per_sec, res.peak_rss_kb, res.allocs_per_step);
+        }
+    }
+
+    if (out)
+        fclose(out);
+    return failed ? -1 : 0;
+}
+
+static int readBench(const char * path, struct BenchResult ** results)
+{
+    FILE * in = fopen(path, "r");
+    if (!in)
+    {
+        fprintf(stderr, "Couldn't open file \"%s\"\n", path);
+        return -1;
+    }
+
+    int cnt = 0, cap = 0;
+    char line[512];
+
+    *results = NULL;
+    while (fgets(line, sizeof(line), in))
+    {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (cnt == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            *results = (struct BenchResult*) realloc(*results, sizeof(struct BenchResult) * cap);
+        }
+
+        struct BenchResult * res = *results + cnt;
+        if (sscanf(line, "%31s %31s %lld %lf %lf %ld %lf", res->workload, res->engine, &res->steps,
+                   &res->ns_per_step, &res->steps_per_sec, &res->peak_rss_kb, &res->allocs_per_step) != 7)
+        {
+            fprintf(stderr, "Invalid benchmark line in \"%s\": %s", path, line);
+            continue;
+        }
+        cnt++;
+    }
+
+    fclose(in);
+    return cnt;
+}
+
+int compareBench(const char * base_path, const char * new_path, double threshold)
+{
+    struct BenchResult * base, * cur;
+
+    int base_cnt = readBench(base_path, &base);
+    int cur_cnt  = readBench(new_path,  &cur);
+    if (base_cnt < 0 || cur_cnt < 0)
+    {
+        free(base_cnt < 0 ? NULL : base);
+        free(cur_cnt  < 0 ? NULL : cur);
+        return -1;
+    }
+
+    printf("%-10s %-8s %12s %12s %9s\n", "workload", "engine", "base ns", "new ns", "change");
+
+    int regressions = 0;
+
+    int i, j;
+    for (i = 0; i < cur_cnt; ++i)
+    {
+        for (j = 0; j < base_cnt; ++j)
+        {
+            if (!strcmp(cur[i].workload, base[j].workload) && !strcmp(cur[i].engine, base[j].engine))
+                break;
+        }
+
+        if (j == base_cnt)
+        {
+            printf("%-10s %-8s %12s %12.2f %9s\n", cur[i].workload, cur[i].engine, "-", cur[i].ns_per_step, "new");
+            continue;
+        }
+
+        if (base[j].ns_per_step <= 0)
+        {
+            printf("%-10s %-8s %12.2f %12.2f %9s\n", cur[i].workload, cur[i].engine,
+                base[j].ns_per_step, cur[i].ns_per_step, "n/a");
+            continue;
+        }
+
+        double change = (cur[i].ns_per_step / base[j].ns_per_step - 1) * 100;
+        printf("%-10s %-8s %12.2f %12.2f %+8.1f%%", cur[i].workload, cur[i].engine,
+            base[j].ns_per_step, cur[i].ns_per_step, change);
+
+        if (change > threshold)
+        {
+            printf("  \x1b[38;2;205;49;49mregression\033[0m");
+            regressions++;
+        }
+        printf("\n");
+    }
+
+    free(base);
+    free(cur);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+ int runBench(const char * out_path, int word_bits, int saturate);
+
+ int compareBench(const char * base_path, const char * new_path, double threshold);
+
+#endif
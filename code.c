@@ -1,7 +1,9 @@
  #include <stdlib.h>
+ #include <string.h>
  #include "code.h"
+ #include "stats.h"
 
- struct Code* loadFromFile(const char* path)
+ struct Code* loadFromFile(const char* path, int flags)
  {
      FILE * stream = fopen(path, "r");
      if (!stream)
@@ -10,14 +12,25 @@
          return NULL;
      }
 
+     struct Code * code = loadFromStream(stream, flags);
+
+     fclose(stream);
+     return code;
+ }
+
+ static struct Code* parseStream(FILE * stream, int flags)
+ {
      struct Code * code = (struct Code*)calloc(1, sizeof(struct Code));
      if (!code)
      {
-         fprintf(stderr, "Couldn't allocate %u bytes for Code struct\n", sizeof(struct Code));
+         fprintf(stderr, "Couldn't allocate %u bytes for Code struct\n", (unsigned int)sizeof(struct Code));
          free(code);
          return NULL;
      }
 
+     code->unified   = (flags & LOAD_UNIFIED) != 0;
+     code->word_bits = 64;
+
      if (readMemoryAsFormat(code, stream))
      {
          codeDtor(code);
@@ -33,13 +46,20 @@
          }
      }
 
-     if (checkCodeFormat(code))
+     if (checkCodeFormat(code) || buildMemoryMap(code))
      {
          codeDtor(code);
          return NULL;
      }
 
-     fclose(stream);
+     return code;
+ }
+
+ struct Code* loadFromStream(FILE * stream, int flags)
+ {
+     STATS_BEGIN(start);
+     struct Code * code = parseStream(stream, flags);
+     STATS_END(STAT_LOAD, start);
      return code;
  }
 
@@ -60,19 +80,7 @@
     }
 
 
-    int keys[19] = {0x99, 0x00, 0x01, 0x02, 0x03, 0x13, 0x04, 0x14, 0x80, 0x81, 0x82, 0x83, 0x93, 0x84, 0x94, 0x85, 0x95, 0x86, 0x96};
-
-    int i, key_valid = 0;
-    for (i = 0; i < sizeof(keys); ++i)
-    {
-        if (cmd->key == keys[i])
-        {
-            key_valid = 1;
-            break;
-        }
-    }
-
-    if (!key_valid)
+    if (!isValidKey(cmd->key))
     {
         fprintf(stderr, "Invalid command key: %x\n", cmd->key);
         return -1;
@@ -121,6 +129,9 @@
         return -1;
     }
 
+    if (code->unified)
+        return 0;
+
     for (i = 0; i < code->mem_cnt; ++i)
     {
         if (code->mem_ptrs[i] >= code->mem_start && code->mem_ptrs[i] < cmd_ptr)
@@ -192,12 +203,11 @@
             }
         }
 
-        int value = INPUT_FLAG;
+        word_t value = INPUT_FLAG;
 
         if (op == '=')
         {
-            err = fscanf(stream, "%d", &value);
-            if (err != 1)
+            if (scanWord(stream, &value))
             {
                 fprintf(stderr, "Invalid memory assignation of %x\n", cell);
                 return -5;
@@ -212,7 +222,7 @@
             else code->mem_cap *= 2;
 
             code->mem_ptrs = (unsigned int*)realloc(code->mem_ptrs, sizeof(unsigned int) * code->mem_cap);
-            code->mem_vals =          (int*)realloc(code->mem_vals, sizeof(         int) * code->mem_cap);
+            code->mem_vals =       (word_t*)realloc(code->mem_vals, sizeof(      word_t) * code->mem_cap);
         }
 
         code->mem_ptrs[code->mem_cnt] = cell;
@@ -242,15 +252,258 @@
     return 0;
  }
 
+ int scanWord(FILE * stream, word_t * value)
+ {
+    int c, neg = 0, digits = 0;
+    do {
+        c = fgetc(stream);
+    } while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+    if (c == '-' || c == '+')
+    {
+        neg = c == '-';
+        c = fgetc(stream);
+    }
+
+    uword_t res = 0;
+    while (c >= '0' && c <= '9')
+    {
+        res = res * 10 + (c - '0');
+        digits++;
+        c = fgetc(stream);
+    }
+
+    if (c != EOF)
+        ungetc(c, stream);
+
+    if (!digits)
+        return -1;
+
+    *value = neg ? (word_t)(0 - res) : (word_t)res;
+    return 0;
+ }
+
+ int formatWord(char * buf, word_t value)
+ {
+    char digits[48];
+    int len = 0, n = 0;
+
+    uword_t u = value < 0 ? 0 - (uword_t)value : (uword_t)value;
+    do {
+        digits[len++] = '0' + (int)(u % 10);
+        u /= 10;
+    } while (u);
+
+    if (value < 0)
+        buf[n++] = '-';
+    while (len)
+        buf[n++] = digits[--len];
+    buf[n] = '\0';
+    return n;
+ }
+
  void printCommand(struct Command cmd, FILE * stream)
  {
      fprintf(stream, "\x1b[38;2;87;106;250m%02x\033[1;97m %04X %04X %04X\033[0m", cmd.key, cmd.arg1, cmd.arg2, cmd.arg3);
  }
 
- void codeDtor(struct Code* code)
+ int buildMemoryMap(struct Code* code)
+ {
+    code->cell_slots = (int*)malloc(sizeof(int) * MEM_SIZE);
+    code->code_map   = (unsigned char*)calloc(MEM_SIZE / 8, 1);
+    code->row_state  = (signed char*)malloc(code->capacity);
+
+    if (!code->cell_slots || !code->code_map || !code->row_state)
+    {
+        fprintf(stderr, "Couldn't allocate memory map\n");
+        return -1;
+    }
+
+    memset(code->cell_slots, -1, sizeof(int) * MEM_SIZE);
+    memset(code->row_state, ROW_DECODED, code->capacity);
+
+    int i;
+    for (i = 0; i < code->mem_cnt; ++i)
+        code->cell_slots[code->mem_ptrs[i]] = i;
+
+    code->slot_cnt = code->mem_cnt;
+
+    if (!code->unified)
+        return 0;
+
+    if (code->mem_cap < code->mem_cnt + code->length)
+    {
+        code->mem_cap  = code->mem_cnt + code->length;
+        code->mem_ptrs = (unsigned int*)realloc(code->mem_ptrs, sizeof(unsigned int) * code->mem_cap);
+        code->mem_vals =       (word_t*)realloc(code->mem_vals, sizeof(      word_t) * code->mem_cap);
+
+        if (!code->mem_ptrs || !code->mem_vals)
+        {
+            fprintf(stderr, "Couldn't allocate memory map\n");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < code->length; ++i)
+    {
+        unsigned int ptr = code->mem_start + i;
+        code->code_map[ptr >> 3] |= 1 << (ptr & 7);
+
+        if (code->cell_slots[ptr] != -1)
+        {
+            code->row_state[i] = ROW_STALE;
+            continue;
+        }
+
+        code->mem_ptrs[code->slot_cnt] = ptr;
+        code->mem_vals[code->slot_cnt] = encodeCommand(code->rows[i]);
+        code->cell_slots[ptr] = code->slot_cnt++;
+    }
+
+    return 0;
+ }
+
+ int isValidKey(int key)
+ {
+    static const int keys[19] = {0x99, 0x00, 0x01, 0x02, 0x03, 0x13, 0x04, 0x14, 0x80, 0x81, 0x82, 0x83, 0x93, 0x84, 0x94, 0x85, 0x95, 0x86, 0x96};
+
+    int i;
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
+    {
+        if (key == keys[i])
+            return 1;
+    }
+    return 0;
+ }
+
+ word_t encodeCommand(struct Command cmd)
+ {
+    return ((word_t)cmd.key  << 48) | ((word_t)cmd.arg1 << 32) |
+           ((word_t)cmd.arg2 << 16) |  (word_t)cmd.arg3;
+ }
+
+ int decodeCommand(struct Command* cmd, word_t word, int bits)
+ {
+    if (bits == 56)
+        word = (word_t)((uword_t)word & (((uword_t)1 << 56) - 1));
+
+    cmd->key  = (int)((word >> 48) & 0xFF);
+    cmd->arg1 = (int)((word >> 32) & 0xFFFF);
+    cmd->arg2 = (int)((word >> 16) & 0xFFFF);
+    cmd->arg3 = (int)( word        & 0xFFFF);
+    cmd->word_length = 1;
+
+    if (word < 0 || (word >> 56) != 0 || !isValidKey(cmd->key))
+        return -1;
+    return 0;
+ }
+
+ struct Command* fetchCommand(struct Code* code, int row)
+ {
+    if (code->row_state[row] == ROW_STALE)
+    {
+        int slot = code->cell_slots[code->mem_start + row];
+        if (decodeCommand(code->rows + row, code->mem_vals[slot], code->word_bits))
+             code->row_state[row] = ROW_INVALID;
+        else code->row_state[row] = ROW_DECODED;
+    }
+
+    if (code->row_state[row] == ROW_INVALID)
+        return NULL;
+    return code->rows + row;
+ }
+
+ void invalidateCell(struct Code* code, unsigned int ptr)
+ {
+    if (ptr < MEM_SIZE && IS_CODE(code, ptr))
+        code->row_state[ptr - code->mem_start] = ROW_STALE;
+ }
+
+ int codeCpy(struct Code * code, struct Code * dest)
+ {
+    dest->capacity  = code->capacity;
+    dest->length    = code->length;
+
+    dest->mem_start = code->mem_start;
+    dest->mem_cnt   = code->mem_cnt;
+    dest->mem_cap   = code->mem_cap;
+
+    dest->unified   = code->unified;
+    dest->slot_cnt  = code->slot_cnt;
+    dest->word_bits = code->word_bits;
+    dest->saturate  = code->saturate;
+
+    dest->rows   = (struct Command*)malloc(sizeof(struct Command) * dest->capacity);
+    dest->mem_ptrs = (unsigned int*)malloc(sizeof(unsigned int) * dest->mem_cap);
+    dest->mem_vals =       (word_t*)malloc(sizeof(      word_t) * dest->mem_cap);
+
+    dest->cell_slots = (int*)malloc(sizeof(int) * MEM_SIZE);
+    dest->code_map   = (unsigned char*)malloc(MEM_SIZE / 8);
+    dest->row_state  = (signed char*)malloc(dest->capacity);
+
+    if (!dest->rows || !dest->mem_ptrs || !dest->mem_vals ||
+        !dest->cell_slots || !dest->code_map || !dest->row_state)
+        return -1;
+
+    memcpy(dest->cell_slots, code->cell_slots, sizeof(int) * MEM_SIZE);
+    memcpy(dest->code_map,   code->code_map,   MEM_SIZE / 8);
+    memcpy(dest->row_state,  code->row_state,  dest->capacity);
+
+    void* err = memcpy(dest->rows, code->rows, sizeof(struct Command) * dest->length);
+    if (err != dest->rows) 
+        return -1;
+
+    err = memcpy(dest->mem_ptrs, code->mem_ptrs, sizeof(unsigned int) * dest->slot_cnt);
+    if (err != dest->mem_ptrs) 
+        return -1;
+
+    err = memcpy(dest->mem_vals, code->mem_vals, sizeof(      word_t) * dest->slot_cnt);
+    if (err != dest->mem_vals) 
+        return -1;
+
+    return 0;
+ }
+
+ void codeReset(struct Code * code, struct Code * image)
+ {
+    memcpy(code->mem_vals, image->mem_vals, sizeof(word_t) * image->slot_cnt);
+    if (image->unified)
+    {
+        memcpy(code->rows, image->rows, sizeof(struct Command) * image->length);
+        memcpy(code->row_state, image->row_state, image->length);
+    }
+ }
+
+ void stripColors(char * dst, const char * src, int size)
+ {
+    int n = 0;
+    while (*src && n + 1 < size)
+    {
+        if (*src == '\x1b')
+        {
+            while (*src && *src != 'm')
+                src++;
+            if (*src)
+                src++;
+            continue;
+        }
+        dst[n++] = *src++;
+    }
+    dst[n] = '\0';
+ }
+
+ void codeFree(struct Code* code)
  {
      free(code->mem_ptrs);
      free(code->mem_vals);
      free(code->rows);
+     free(code->cell_slots);
+     free(code->code_map);
+     free(code->row_state);
+ }
+
+ void codeDtor(struct Code* code)
+ {
+     codeFree(code);
      free(code);
  }
\ No newline at end of file
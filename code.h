@@ -1,11 +1,24 @@
-#include <stdio.h> 
- 
+#ifndef CODE_H
+#define CODE_H
+
+#include <stdio.h>
+
+#ifdef UM3_WIDE_WORDS
+ typedef __int128 word_t;
+ typedef unsigned __int128 uword_t;
+#else
+ typedef long long word_t;
+ typedef unsigned long long uword_t;
+#endif
+
+ #define WORD_MAX_BITS ((int)sizeof(word_t) * 8)
+
  struct Command {
      int key;
      int arg1, arg2, arg3;
      int word_length;
  };
- 
+
  struct Code {
      struct Command* rows;
      int length;
@@ -14,12 +27,34 @@
      int mem_cnt, mem_cap;
 
      unsigned int* mem_ptrs;
-              int* mem_vals;
+           word_t* mem_vals;
+
+     int unified;
+     int slot_cnt;
+
+     int word_bits;
+     int saturate;
+
+     int* cell_slots;
+     unsigned char* code_map;
+     signed char* row_state;
  };
 
  #define INPUT_FLAG 0xB0BACEBA
 
- struct Code* loadFromFile(const char* path);
+ #define MEM_SIZE (1 << 16)
+
+ #define LOAD_UNIFIED 1
+
+ #define ROW_STALE    0
+ #define ROW_DECODED  1
+ #define ROW_INVALID -1
+
+ #define IS_CODE(code, ptr) ((code)->code_map[(ptr) >> 3] & (1 << ((ptr) & 7)))
+
+ struct Code* loadFromFile(const char* path, int flags);
+
+ struct Code* loadFromStream(FILE * stream, int flags);
 
  int readLineAsFormat(struct Command* cmd, FILE * stream, int line);
 
@@ -29,6 +64,32 @@
 
  int readCommandLine(struct Code* code, FILE * stream);
 
+ int buildMemoryMap(struct Code* code);
+
+ int isValidKey(int key);
+
+ word_t encodeCommand(struct Command cmd);
+
+ int decodeCommand(struct Command* cmd, word_t word, int bits);
+
+ struct Command* fetchCommand(struct Code* code, int row);
+
+ void invalidateCell(struct Code* code, unsigned int ptr);
+
+ int scanWord(FILE * stream, word_t * value);
+
+ int formatWord(char * buf, word_t value);
+
  void printCommand(struct Command cmd, FILE * stream);
 
- void codeDtor(struct Code * code);
\ No newline at end of file
+ int codeCpy(struct Code * code, struct Code * dest);
+
+ void codeReset(struct Code * code, struct Code * image);
+
+ void stripColors(char * dst, const char * src, int size);
+
+ void codeFree(struct Code * code);
+
+ void codeDtor(struct Code * code);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <string.h>
+#include "engine.h"
+#include "diff.h"
+
+#define DIFF_BLOCK      (1 << 14)
+#define DIFF_WINDOW     8
+#define DIFF_WATCH      4
+
+struct DiffRun {
+    struct Code * code;
+    StepFunc step;
+    unsigned char * tracked;
+
+    int cmd_i, cmd_ptr;
+    int status;
+    char err_str[128];
+    unsigned long long hash;
+    unsigned long long path;
+
+    struct Code ck[2];
+    long long ck_step[2];
+    int ck_i[2], ck_ptr[2];
+    int ck_last;
+};
+
+static unsigned long long cellHash(unsigned int ptr, word_t value)
+{
+    unsigned long long x = (unsigned long long)value;
+    if (sizeof(word_t) > 8)
+        x ^= (unsigned long long)((uword_t)value >> 32 >> 32) * 0xC2B2AE3D27D4EB4FULL;
+
+    x += (ptr + 1ULL) * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static unsigned long long diffHash(struct DiffRun * run)
+{
+    unsigned long long hash = 0;
+    int i;
+    for (i = 0; i < run->code->slot_cnt; ++i)
+        if (run->tracked[i])
+            hash += cellHash(run->code->mem_ptrs[i], run->code->mem_vals[i]);
+    return hash;
+}
+
+static int diffInit(struct DiffRun * run, struct Code * code, struct Code * other)
+{
+    run->code    = code;
+    run->step    = selectStep(code);
+    run->cmd_ptr = code->mem_start;
+
+    run->tracked = (unsigned char*) malloc(code->slot_cnt + 1);
+    if (!run->tracked)
+        return -1;
+
+    int i;
+    for (i = 0; i < code->slot_cnt; ++i)
+        run->tracked[i] = other->cell_slots[code->mem_ptrs[i]] >= 0;
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (codeCpy(code, run->ck + i))
+            return -1;
+        run->ck_ptr[i] = code->mem_start;
+    }
+    return 0;
+}
+
+static void diffFree(struct DiffRun * run)
+{
+    free(run->tracked);
+    codeFree(run->ck);
+    codeFree(run->ck + 1);
+}
+
+static void diffCheckpoint(struct DiffRun * run, long long steps)
+{
+    int k = !run->ck_last;
+    codeReset(run->ck + k, run->code);
+    run->ck_step[k] = steps;
+    run->ck_i[k]    = run->cmd_i;
+    run->ck_ptr[k]  = run->cmd_ptr;
+    run->ck_last    = k;
+}
+
+static long long diffRestore(struct DiffRun * run, long long steps)
+{
+    int k = run->ck_step[run->ck_last] <= steps ? run->ck_last : !run->ck_last;
+    codeReset(run->code, run->ck + k);
+    run->cmd_i   = run->ck_i[k];
+    run->cmd_ptr = run->ck_ptr[k];
+    run->status  = 0;
+    run->hash    = diffHash(run);
+    return run->ck_step[k];
+}
+
+static long long diffBlock(struct DiffRun * run, long long max_steps)
+{
+    long long steps = 0;
+    while (steps < max_steps && !run->status)
+    {
+        steps++;
+        run->status = run->step(run->code, run->err_str, &run->cmd_i, &run->cmd_ptr);
+        run->path = (run->path ^ (unsigned int)run->cmd_ptr) * 1099511628211ULL;
+    }
+    return steps;
+}
+
+static struct Command * diffCommand(struct DiffRun * run)
+{
+    struct Code * code = run->code;
+    if (run->cmd_i < 0 || run->cmd_i >= code->length)
+        return NULL;
+    return code->unified ? fetchCommand(code, run->cmd_i) : code->rows + run->cmd_i;
+}
+
+static void diffStep(struct DiffRun * run)
+{
+    if (run->status)
+        return;
+
+    struct Code * code = run->code;
+    struct Command * cmd = diffCommand(run);
+
+    int slots[2], cnt = 0;
+    word_t old[2];
+    if (cmd)
+        cnt = commandTargets(code, cmd, slots);
+
+    int i;
+    for (i = 0; i < cnt; ++i)
+        old[i] = code->mem_vals[slots[i]];
+
+    run->status = run->step(code, run->err_str, &run->cmd_i, &run->cmd_ptr);
+
+    for (i = 0; i < cnt; ++i)
+    {
+        word_t val = code->mem_vals[slots[i]];
+        if (run->tracked[slots[i]] && val != old[i])
+            run->hash += cellHash(code->mem_ptrs[slots[i]], val) - cellHash(code->mem_ptrs[slots[i]], old[i]);
+    }
+}
+
+static int diffCells(struct DiffRun * a, struct DiffRun * b, unsigned int * ptrs, int max_cnt)
+{
+    int i, cnt = 0;
+    for (i = 0; i < a->code->slot_cnt; ++i)
+    {
+        if (!a->tracked[i])
+            continue;
+
+        unsigned int ptr = a->code->mem_ptrs[i];
+        if (a->code->mem_vals[i] != b->code->mem_vals[b->code->cell_slots[ptr]])
+        {
+            if (cnt < max_cnt)
+                ptrs[cnt] = ptr;
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+static int diverged(struct DiffRun * a, struct DiffRun * b, int cells)
+{
+    if (a->status != b->status)
+        return 1;
+    if (a->status)
+        return strcmp(a->err_str, b->err_str) != 0;
+    return a->cmd_ptr != b->cmd_ptr || (cells && a->hash != b->hash);
+}
+
+static void printSide(struct DiffRun * run)
+{
+    char text[128];
+    if (run->status)
+    {
+        stripColors(text, run->err_str, sizeof(text));
+        printf("%-30.30s", text);
+        return;
+    }
+
+    struct Command * cmd = diffCommand(run);
+    printf("0x%04X : ", run->cmd_ptr);
+    if (cmd)
+        printCommand(*cmd, stdout);
+    else printf("?? ???? ???? ????");
+    printf("    ");
+}
+
+static void printWatch(struct DiffRun * a, struct DiffRun * b, unsigned int * watch, int watch_cnt)
+{
+    int i;
+    for (i = 0; i < watch_cnt; ++i)
+    {
+        char va[48], vb[48], cell[100];
+        formatWord(va, a->code->mem_vals[a->code->cell_slots[watch[i]]]);
+        formatWord(vb, b->code->mem_vals[b->code->cell_slots[watch[i]]]);
+
+        if (strcmp(va, vb))
+             snprintf(cell, sizeof(cell), "%s | %s", va, vb);
+        else snprintf(cell, sizeof(cell), "%s", va);
+        printf(" %-22s", cell);
+    }
+}
+
+static void printWindow(struct DiffRun * a, struct DiffRun * b, long long diff_step, unsigned int * watch, int watch_cnt)
+{
+    long long first = diff_step > DIFF_WINDOW ? diff_step - DIFF_WINDOW : 0;
+
+    long long steps = diffRestore(a, first);
+    diffRestore(b, first);
+    while (steps < first)
+    {
+        diffStep(a);
+        diffStep(b);
+        steps++;
+    }
+
+    int i;
+    printf("\n     %10s   %-30s%-30s", "step", "A", "B");
+    for (i = 0; i < watch_cnt; ++i)
+        printf(" 0x%04X%16s", watch[i], "");
+    printf("\n");
+
+    for (; steps <= diff_step + DIFF_WINDOW; ++steps)
+    {
+        printf("  %s %10lld   ", steps == diff_step ? ">>" : "  ", steps);
+        printSide(a);
+        printSide(b);
+        printWatch(a, b, watch, watch_cnt);
+        printf("\n");
+
+        if (a->status && b->status)
+            break;
+        diffStep(a);
+        diffStep(b);
+    }
+}
+
+int runDiff(struct Code * a_code, struct Code * b_code, long long max_steps)
+{
+    struct DiffRun a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+
+    if (diffInit(&a, a_code, b_code) || diffInit(&b, b_code, a_code))
+    {
+        fprintf(stderr, "Couldn't allocate memory for diff\n");
+        diffFree(&a);
+        diffFree(&b);
+        return -1;
+    }
+
+    unsigned int watch[DIFF_WATCH];
+    int cells = !diffCells(&a, &b, watch, DIFF_WATCH);
+    if (!cells)
+        printf("Initial cell values differ, comparing control flow only\n");
+
+    long long steps = 0;
+    while (!a.status && !b.status && steps < max_steps)
+    {
+        diffCheckpoint(&a, steps);
+        diffCheckpoint(&b, steps);
+
+        long long block = max_steps - steps < DIFF_BLOCK ? max_steps - steps : DIFF_BLOCK;
+        long long done_a = diffBlock(&a, block);
+        long long done_b = diffBlock(&b, block);
+
+        if (done_a == done_b && a.path == b.path && !diverged(&a, &b, 0) &&
+            (!cells || !diffCells(&a, &b, watch, 0)))
+        {
+            steps += done_a;
+            continue;
+        }
+
+        long long last = steps + (done_a > done_b ? done_a : done_b);
+        diffRestore(&a, steps);
+        diffRestore(&b, steps);
+        while (!diverged(&a, &b, cells) && steps < last)
+        {
+            diffStep(&a);
+            diffStep(&b);
+            steps++;
+        }
+        break;
+    }
+
+    if (!diverged(&a, &b, cells))
+    {
+        if (a.status)
+        {
+            char text[128];
+            stripColors(text, a.err_str, sizeof(text));
+            printf("No divergence: both runs %s after %lld steps\n", text, steps);
+        }
+        else printf("No divergence in %lld steps\n", steps);
+
+        diffFree(&a);
+        diffFree(&b);
+        return 0;
+    }
+
+    int watch_cnt = diffCells(&a, &b, watch, DIFF_WATCH);
+    if (watch_cnt > DIFF_WATCH)
+        watch_cnt = DIFF_WATCH;
+
+    printf("Divergence at step %lld: ", steps);
+    if (a.status != b.status || a.status)
+        printf("runs ended differently\n");
+    else if (a.cmd_ptr != b.cmd_ptr)
+        printf("control flow differs (A at 0x%04X, B at 0x%04X)\n", a.cmd_ptr, b.cmd_ptr);
+    else printf("cell values differ\n");
+
+    printWindow(&a, &b, steps, watch, watch_cnt);
+
+    diffFree(&a);
+    diffFree(&b);
+    return 1;
+}
@@ -0,0 +1,8 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "code.h"
+
+ int runDiff(struct Code * a, struct Code * b, long long max_steps);
+
+#endif
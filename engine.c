@@ -0,0 +1,684 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "engine.h"
+#include "stats.h"
+
+const int MAX_STATE_LENGTH = 1 << 20;
+
+__thread long long engine_allocs = 0;
+
+static void * engineMalloc(size_t size)
+{
+    engine_allocs++;
+    return malloc(size);
+}
+
+static void * engineRealloc(void * ptr, size_t size)
+{
+    engine_allocs++;
+    return realloc(ptr, size);
+}
+
+static inline word_t wordMax(int bits)
+{
+    return (word_t)(((uword_t)1 << (bits - 1)) - 1);
+}
+
+static inline word_t wrapWord(word_t value, int bits)
+{
+    int shift = WORD_MAX_BITS - bits;
+    if (!shift)
+        return value;
+    return (word_t)((uword_t)value << shift) >> shift;
+}
+
+static inline word_t clampWord(word_t value, int bits)
+{
+    if (bits == WORD_MAX_BITS)
+        return value;
+    if (value > wordMax(bits))
+        return wordMax(bits);
+    if (value < -wordMax(bits) - 1)
+        return -wordMax(bits) - 1;
+    return value;
+}
+
+static inline word_t addWord(word_t a, word_t b, int bits, int sat)
+{
+    word_t res;
+    if (!sat)
+        return wrapWord((word_t)((uword_t)a + (uword_t)b), bits);
+    if (__builtin_add_overflow(a, b, &res))
+        return b < 0 ? -wordMax(bits) - 1 : wordMax(bits);
+    return clampWord(res, bits);
+}
+
+static inline word_t subWord(word_t a, word_t b, int bits, int sat)
+{
+    word_t res;
+    if (!sat)
+        return wrapWord((word_t)((uword_t)a - (uword_t)b), bits);
+    if (__builtin_sub_overflow(a, b, &res))
+        return b > 0 ? -wordMax(bits) - 1 : wordMax(bits);
+    return clampWord(res, bits);
+}
+
+static inline word_t mulWord(word_t a, word_t b, int bits, int sat)
+{
+    word_t res;
+    if (!sat)
+        return wrapWord((word_t)((uword_t)a * (uword_t)b), bits);
+    if (__builtin_mul_overflow(a, b, &res))
+        return (a < 0) != (b < 0) ? -wordMax(bits) - 1 : wordMax(bits);
+    return clampWord(res, bits);
+}
+
+word_t fitWord(struct Code * code, word_t value)
+{
+    if (code->saturate)
+        return clampWord(value, code->word_bits);
+    return wrapWord(value, code->word_bits);
+}
+
+int setWordWidth(struct Code * code, int bits, int saturate)
+{
+    if (bits < 2 || bits > WORD_MAX_BITS)
+    {
+        fprintf(stderr, "Word width must be in range [2, %d]\n", (int)WORD_MAX_BITS);
+#ifndef UM3_WIDE_WORDS
+        if (bits > WORD_MAX_BITS && bits <= 128)
+            fprintf(stderr, "Widths up to 128 bits need a build with -DUM3_WIDE_WORDS\n");
+#endif
+        return -1;
+    }
+
+    if (code->unified && bits < 56)
+    {
+        fprintf(stderr, "Unified memory needs at least 56-bit words to hold commands\n");
+        return -1;
+    }
+
+    code->word_bits = bits;
+    code->saturate  = saturate != 0;
+
+    int i;
+    for (i = 0; i < code->slot_cnt; ++i)
+    {
+        if (code->unified && IS_CODE(code, code->mem_ptrs[i]))
+            continue;
+        if (code->mem_vals[i] != INPUT_FLAG)
+            code->mem_vals[i] = fitWord(code, code->mem_vals[i]);
+    }
+    return 0;
+}
+
+void stepMessage(char * err_str, int kind, int arg)
+{
+    switch (kind)
+    {
+        case STEP_FINISHED:
+            sprintf(err_str, "\x1b[38;2;44;124;237msuccessfully finished\033[0m");
+            break;
+        case STEP_UNDEFINED_CELL:
+            sprintf(err_str, "\x1b[38;2;205;49;49mundefined cell 0x%04X\033[0m", arg);
+            break;
+        case STEP_DIVIDE_BY_ZERO:
+            sprintf(err_str, "\x1b[38;2;205;49;49mtrying to divide by zero\033[0m");
+            break;
+        case STEP_NO_COMMAND:
+            sprintf(err_str, "\x1b[38;2;205;49;49mno command at cell 0x%04X\033[0m", arg);
+            break;
+        case STEP_TERMINATED:
+            sprintf(err_str, "\x1b[38;2;205;49;49mforced to terminate at 0x%04X\033[0m", arg);
+            break;
+        case STEP_INVALID_COMMAND:
+            sprintf(err_str, "\x1b[38;2;205;49;49minvalid command at cell 0x%04X\033[0m", arg);
+            break;
+    }
+}
+
+word_t * findCell(struct Code * code, unsigned int ptr)
+{
+    if (ptr >= MEM_SIZE || code->cell_slots[ptr] == -1)
+        return NULL;
+    return code->mem_vals + code->cell_slots[ptr];
+}
+
+int findCommandKey(struct Code * code, int ptr)
+{
+    if (ptr >= code->mem_start && ptr < code->mem_start + code->length)
+        return ptr - code->mem_start;
+    return ptr == code->mem_start + code->length ? -2 : -1;
+}
+
+static inline __attribute__((always_inline))
+int stepCommand(struct Code * code, char * err_str, int * cmd_i, int * cmd_ptr, int bits, int sat)
+{
+    struct Command * cmd = code->unified ? fetchCommand(code, *cmd_i) : code->rows + *cmd_i;
+
+    if (!cmd)
+    {
+        stepMessage(err_str, STEP_INVALID_COMMAND, *cmd_ptr);
+        return -1;
+    }
+
+    word_t * arg1_v = NULL;
+    word_t * arg2_v = NULL;
+    word_t * arg3_v = NULL;
+
+    if (cmd->key != 0x99 && (cmd->key < 0x80 || cmd->key > 0x96))
+    {
+        arg3_v = findCell(code, cmd->arg3);
+        if (!arg3_v)
+        {
+            stepMessage(err_str, STEP_UNDEFINED_CELL, cmd->arg3);
+            return -1;
+        }
+    }
+
+    if (cmd->key != 0x99 && cmd->key != 0x80)
+    {
+        arg1_v = findCell(code, cmd->arg1);
+        if (!arg1_v)
+        {
+            stepMessage(err_str, STEP_UNDEFINED_CELL, cmd->arg1);
+            return -1;
+        }
+    }
+
+    if (cmd->key != 0x99 && cmd->key != 0x80 && cmd->key != 0x00)
+    {
+        arg2_v = findCell(code, cmd->arg2);
+        if (!arg2_v)
+        {
+            stepMessage(err_str, STEP_UNDEFINED_CELL, cmd->arg2);
+            return -1;
+        }
+    }
+
+    switch (cmd->key)
+    {
+        case 0x99:
+        {
+            stepMessage(err_str, STEP_FINISHED, 0);
+            return 1;
+        }
+        case 0x00:
+        {
+            *arg3_v = *arg1_v;
+            (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x01:
+        {
+            *arg3_v = addWord(*arg1_v, *arg2_v, bits, sat);
+            (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x02:
+        {
+            *arg3_v = subWord(*arg1_v, *arg2_v, bits, sat);
+            (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x03:
+        case 0x13:
+        {
+            *arg3_v = mulWord(*arg1_v, *arg2_v, bits, sat);
+            (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x04:
+        case 0x14:
+        {
+            word_t * arg4_v = findCell(code, cmd->arg3 + 1);
+
+            if (*arg2_v == 0)
+            {
+                stepMessage(err_str, STEP_DIVIDE_BY_ZERO, 0);
+                return -1;
+            }
+
+            word_t del = 0, mod = 0;
+            if (*arg2_v == -1)
+                del = subWord(0, *arg1_v, bits, sat);
+            else
+            {
+                del = *arg1_v / *arg2_v;
+                mod = *arg1_v - *arg2_v * del;
+            }
+
+            *arg3_v = del;
+            if (arg4_v)
+                *arg4_v = mod;
+
+            if (code->unified)
+                invalidateCell(code, cmd->arg3 + 1);
+            
+            (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x80:
+        {
+            (*cmd_ptr) = cmd->arg3;
+            break;
+        }
+        case 0x81:
+        {
+            if (*arg1_v == *arg2_v)
+                (*cmd_ptr) = cmd->arg3;
+            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x82:
+        {
+            if (*arg1_v != *arg2_v)
+                (*cmd_ptr) = cmd->arg3;
+            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x83:
+        case 0x93:
+        {
+            if (*arg1_v < *arg2_v)
+                (*cmd_ptr) = cmd->arg3;
+            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x84:
+        case 0x94:
+        {
+            if (*arg1_v >= *arg2_v)
+                (*cmd_ptr) = cmd->arg3;
+            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x85:
+        case 0x95:
+        {
+            if (*arg1_v > *arg2_v)
+                (*cmd_ptr) = cmd->arg3;
+            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+        case 0x86:
+        case 0x96:
+        {
+            if (*arg1_v <= *arg2_v)
+                (*cmd_ptr) = cmd->arg3;
+            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
+            break;
+        }
+    }
+
+    if (code->unified && arg3_v)
+        invalidateCell(code, cmd->arg3);
+
+    *cmd_i = findCommandKey(code, *cmd_ptr);
+    if (*cmd_i == -1)
+    {
+        stepMessage(err_str, STEP_NO_COMMAND, *cmd_ptr);
+        return -1;
+    }
+    else if (*cmd_i == -2)
+    {
+        stepMessage(err_str, STEP_TERMINATED, *cmd_ptr);
+        return -1;
+    }
+
+    return 0;
+}
+
+int runCommand(struct Code * code, char * err_str, int * cmd_i, int * cmd_ptr)
+{
+    return stepCommand(code, err_str, cmd_i, cmd_ptr, code->word_bits, code->saturate);
+}
+
+#define DEFINE_STEP(name, bits, sat)                                                 \
+    static int name(struct Code * code, char * err_str, int * cmd_i, int * cmd_ptr) \
+    {                                                                                \
+        return stepCommand(code, err_str, cmd_i, cmd_ptr, bits, sat);                \
+    }
+
+DEFINE_STEP(runCommand32,  32, 0)
+DEFINE_STEP(runCommand32s, 32, 1)
+DEFINE_STEP(runCommand56,  56, 0)
+DEFINE_STEP(runCommand56s, 56, 1)
+DEFINE_STEP(runCommand64,  64, 0)
+DEFINE_STEP(runCommand64s, 64, 1)
+#ifdef UM3_WIDE_WORDS
+DEFINE_STEP(runCommand128,  128, 0)
+DEFINE_STEP(runCommand128s, 128, 1)
+#endif
+
+long long runSteps(struct Code * code, StepFunc step, long long max_steps, int * status, char * err_str)
+{
+    int cmd_i = 0, cmd_ptr = code->mem_start;
+    long long steps = 0;
+
+    STATS_BEGIN(start);
+    PROBE_RUN_START(code->length);
+
+    *status = 0;
+    while (steps < max_steps)
+    {
+        steps++;
+        if ((*status = step(code, err_str, &cmd_i, &cmd_ptr)))
+            break;
+    }
+
+    if (!*status)
+    {
+        PROBE_STEP_LIMIT(steps);
+        STATS_COUNT(STAT_LIMITS, 1);
+    }
+    PROBE_RUN_FINISH(steps, *status);
+
+    STATS_END(STAT_RUN, start);
+    STATS_COUNT(STAT_STEPS, steps);
+    STATS_COUNT(STAT_RUNS, 1);
+    return steps;
+}
+
+StepFunc selectStep(struct Code * code)
+{
+    switch (code->word_bits)
+    {
+        case 32: return code->saturate ? runCommand32s : runCommand32;
+        case 56: return code->saturate ? runCommand56s : runCommand56;
+        case 64: return code->saturate ? runCommand64s : runCommand64;
+#ifdef UM3_WIDE_WORDS
+        case 128: return code->saturate ? runCommand128s : runCommand128;
+#endif
+    }
+    return runCommand;
+}
+
+void stateInit(struct State * st)
+{
+    st->length    = 0;
+    st->capacity  = 0;
+    st->rows      = NULL;
+    st->col_sizes = NULL;
+    st->mapped    = NULL;
+    st->error[0]  = '\0';
+
+    memset(st->rowHashes, 0, sizeof(unsigned int) * HASH_MOD);
+}
+
+void stateFree(struct State * st)
+{
+    int i;
+    for (i = 0; i < st->length; ++i)
+        stateFreeValues(st, st->rows[i].values);
+    free(st->rows);
+    free(st->col_sizes);
+
+    if (st->mapped)
+        munmap(st->mapped, st->mapped_size);
+}
+
+void stateFreeValues(struct State * st, word_t * values)
+{
+    char * ptr = (char *) values;
+    if (!st->mapped || ptr < st->mapped || ptr >= st->mapped + st->mapped_size)
+        free(values);
+}
+
+unsigned int getHash(struct CodeRow * row, int vals)
+{
+    unsigned int hash = (row->cmd_ptr * 997) % HASH_MOD;
+    for (int i = 0; i < vals; ++i)
+    {
+        hash = (hash * 997 + 10 * (unsigned int)row->values[i]) % HASH_MOD;
+    }
+
+    return hash % HASH_MOD;
+}
+
+static int statePushRow(struct State * st, struct Code * code, struct CodeRow row)
+{
+    if (st->capacity == st->length)
+    {
+        st->capacity = (st->capacity == 0) ? code->length : st->capacity * 2;
+        st->rows = (struct CodeRow *)engineRealloc(st->rows, sizeof(struct CodeRow) * st->capacity);
+    }
+    st->rows[st->length] = row;
+
+    unsigned int h = getHash(&st->rows[st->length], code->slot_cnt);
+
+    st->length++;
+
+    if (st->length >= MAX_STATE_LENGTH)
+    {
+        PROBE_STEP_LIMIT(st->length);
+        STATS_COUNT(STAT_LIMITS, 1);
+        sprintf(st->error, "\x1b[38;2;205;49;49mstopped after %d'th row\033[0m", st->length);
+        return -1;
+    }
+
+    if (st->rowHashes[h])
+    {
+        int is_eq = st->rows[st->rowHashes[h] - 1].cmd_ptr == st->rows[st->length - 1].cmd_ptr;
+        for (int i = 0; i < code->slot_cnt; ++i)
+        {
+            is_eq &= (st->rows[st->rowHashes[h] - 1].values[i] == st->rows[st->length - 1].values[i]);
+        }
+
+        if (is_eq)
+        {
+            PROBE_LOOP_FOUND(st->rows[st->rowHashes[h] - 1].cmd_ptr, st->rows[st->length - 1].cmd_ptr);
+            STATS_COUNT(STAT_LOOPS, 1);
+            sprintf(st->error, "\x1b[38;2;205;49;49minfinite loop found : rows [0x%04X - 0x%04X]\033[0m", 
+            st->rows[st->rowHashes[h] - 1].cmd_ptr, 
+            st->rows[st->length - 1].cmd_ptr
+            );
+
+            st->rowHashes[h] = st->length;
+            return -1;
+        }
+    }
+
+    st->rowHashes[h] = st->length;
+    return 0;
+}
+
+int stateAddRow(struct State * st, struct Code * code, int cmd_key, int cmd_ptr)
+{
+    STATS_BEGIN(start);
+
+    struct CodeRow row;
+    row.cmd_key = cmd_key;
+    row.cmd_ptr = cmd_ptr;
+
+    row.values = (word_t*) engineMalloc(sizeof(word_t) * code->slot_cnt);
+    memcpy(row.values, code->mem_vals, sizeof(word_t) * code->slot_cnt);
+
+    int status = statePushRow(st, code, row);
+    STATS_END(STAT_ADD_ROW, start);
+    return status;
+}
+
+int stateRowCommand(struct Code * code, struct CodeRow * row, struct Command * cmd)
+{
+    if (!code->unified)
+    {
+        *cmd = code->rows[row->cmd_key];
+        return 0;
+    }
+    return decodeCommand(cmd, row->values[code->cell_slots[row->cmd_ptr]], code->word_bits);
+}
+
+static int commandReads(struct Code * code, struct Command cmd, int cmd_ptr, int ptr)
+{
+    if (code->unified && cmd_ptr == ptr)
+        return 1;
+    if (cmd.key == 0x80 || cmd.key == 0x99)
+        return 0;
+    if (cmd.key == 0x00)
+        return cmd.arg1 == ptr;
+    return cmd.arg1 == ptr || cmd.arg2 == ptr;
+}
+
+int commandOperands(struct Code * code, struct Command * cmd, int * slots)
+{
+    int cnt = 0;
+    if (cmd->key == 0x80 || cmd->key == 0x99)
+        return 0;
+
+    if (code->cell_slots[cmd->arg1] >= 0)
+        slots[cnt++] = code->cell_slots[cmd->arg1];
+    if (cmd->key != 0x00 && code->cell_slots[cmd->arg2] >= 0)
+        slots[cnt++] = code->cell_slots[cmd->arg2];
+    return cnt;
+}
+
+int commandTargets(struct Code * code, struct Command * cmd, int * slots)
+{
+    int cnt = 0;
+    if (cmd->key >= 0x80)
+        return 0;
+
+    if (code->cell_slots[cmd->arg3] >= 0)
+        slots[cnt++] = code->cell_slots[cmd->arg3];
+    if ((cmd->key == 0x04 || cmd->key == 0x14) && cmd->arg3 + 1 < MEM_SIZE && code->cell_slots[cmd->arg3 + 1] >= 0)
+        slots[cnt++] = code->cell_slots[cmd->arg3 + 1];
+    return cnt;
+}
+
+static int commandWrites(struct Command cmd, int ptr)
+{
+    if (cmd.key >= 0x80)
+        return 0;
+    return cmd.arg3 == ptr || ((cmd.key == 0x04 || cmd.key == 0x14) && cmd.arg3 + 1 == ptr);
+}
+
+static void stateRestore(struct State * st, struct Code * code, int * cmd_key, int * cmd_ptr)
+{
+    struct CodeRow * row = st->rows + st->length - 1;
+    memcpy(code->mem_vals, row->values, sizeof(word_t) * code->slot_cnt);
+    *cmd_key = row->cmd_key;
+    *cmd_ptr = row->cmd_ptr;
+
+    if (code->unified)
+        memset(code->row_state, ROW_STALE, code->length);
+}
+
+static int stateProbeEnd(struct State * st, struct Code * code, StepFunc step, int * cmd_key, int * cmd_ptr)
+{
+    int status = step(code, st->error, cmd_key, cmd_ptr);
+    if (!status)
+    {
+        st->error[0] = '\0';
+        stateRestore(st, code, cmd_key, cmd_ptr);
+    }
+    return status;
+}
+
+static int stateRehash(struct State * st, struct Code * code, int length)
+{
+    memset(st->rowHashes, 0, sizeof(unsigned int) * HASH_MOD);
+    st->length = 0;
+
+    int i, status = 0;
+    for (i = 0; i < length; ++i)
+    {
+        if (!status)
+            status = statePushRow(st, code, st->rows[i]);
+        else stateFreeValues(st, st->rows[i].values);
+    }
+    return status;
+}
+
+static int rowsEqual(struct CodeRow * a, struct CodeRow * b, int vals)
+{
+    return a->cmd_ptr == b->cmd_ptr && !memcmp(a->values, b->values, sizeof(word_t) * vals);
+}
+
+int stateEditCell(struct State * st, struct Code * code, StepFunc step, int row, unsigned int ptr, word_t value, int * cmd_key, int * cmd_ptr, int * rerun_from, int * rerun_to)
+{
+    int slot = code->cell_slots[ptr];
+    int old_len = st->length;
+    int reader = -1;
+
+    *rerun_from = *rerun_to = 0;
+
+    int k;
+    for (k = row; k + 1 < old_len; ++k)
+    {
+        struct Command cmd;
+        if (stateRowCommand(code, st->rows + k, &cmd) || commandReads(code, cmd, st->rows[k].cmd_ptr, (int)ptr))
+        {
+            reader = k;
+            break;
+        }
+        if (commandWrites(cmd, (int)ptr))
+            break;
+    }
+
+    int i;
+    for (i = row; i <= k; ++i)
+        st->rows[i].values[slot] = value;
+    st->error[0] = '\0';
+
+    if (reader < 0)
+    {
+        int status = stateRehash(st, code, old_len);
+        stateRestore(st, code, cmd_key, cmd_ptr);
+        return status ? status : stateProbeEnd(st, code, step, cmd_key, cmd_ptr);
+    }
+
+    int old_cnt = old_len - reader - 1;
+    struct CodeRow * old = (struct CodeRow *) engineMalloc(sizeof(struct CodeRow) * (old_cnt + 1));
+    int * chain = (int*) engineMalloc(sizeof(int) * (old_cnt + HASH_MOD));
+    memcpy(old, st->rows + reader + 1, sizeof(struct CodeRow) * old_cnt);
+
+    int status = stateRehash(st, code, reader + 1);
+    stateRestore(st, code, cmd_key, cmd_ptr);
+    *rerun_from = *rerun_to = st->length;
+
+    int * heads = chain + old_cnt;
+    for (i = 0; i < HASH_MOD; ++i)
+        heads[i] = -1;
+    for (i = old_cnt - 1; i >= 0; --i)
+    {
+        unsigned int h = getHash(old + i, code->slot_cnt);
+        chain[i] = heads[h];
+        heads[h] = i;
+    }
+
+    int used = 0;
+    while (!status && st->length < old_len)
+    {
+        if ((status = step(code, st->error, cmd_key, cmd_ptr)))
+            break;
+        status = stateAddRow(st, code, *cmd_key, *cmd_ptr);
+        *rerun_to = st->length;
+        if (status)
+            break;
+
+        struct CodeRow * last = st->rows + st->length - 1;
+        int match = heads[getHash(last, code->slot_cnt)];
+        while (match >= 0 && !rowsEqual(old + match, last, code->slot_cnt))
+            match = chain[match];
+
+        if (match >= 0)
+        {
+            for (i = 0; i <= match; ++i)
+                stateFreeValues(st, old[i].values);
+            for (i = match + 1; i < old_cnt && !status; ++i)
+                status = statePushRow(st, code, old[i]);
+            used = i;
+            stateRestore(st, code, cmd_key, cmd_ptr);
+            break;
+        }
+    }
+
+    for (i = used; i < old_cnt; ++i)
+        stateFreeValues(st, old[i].values);
+
+    free(old);
+    free(chain);
+    return status ? status : stateProbeEnd(st, code, step, cmd_key, cmd_ptr);
+}
@@ -0,0 +1,74 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "code.h"
+
+ #define HASH_MOD 10007
+
+ extern const int MAX_STATE_LENGTH;
+
+ extern __thread long long engine_allocs;
+
+ #define STEP_FINISHED         0
+ #define STEP_UNDEFINED_CELL   1
+ #define STEP_DIVIDE_BY_ZERO   2
+ #define STEP_NO_COMMAND       3
+ #define STEP_TERMINATED       4
+ #define STEP_INVALID_COMMAND  5
+
+ struct CodeRow {
+     int cmd_ptr;
+     int cmd_key;
+     word_t * values;
+ };
+
+ struct State {
+     char error[70];
+     struct CodeRow * rows;
+     int * col_sizes;
+     int capacity;
+     int length;
+
+     char * mapped;
+     long long mapped_size;
+
+     unsigned int rowHashes[HASH_MOD];
+ };
+
+ typedef int (*StepFunc)(struct Code * code, char * err_str, int * cmd_i, int * cmd_ptr);
+
+ void stepMessage(char * err_str, int kind, int arg);
+
+ word_t * findCell(struct Code * code, unsigned int ptr);
+
+ int findCommandKey(struct Code * code, int ptr);
+
+ int runCommand(struct Code * code, char * err_str, int * cmd_i, int * cmd_ptr);
+
+ StepFunc selectStep(struct Code * code);
+
+ int setWordWidth(struct Code * code, int bits, int saturate);
+
+ word_t fitWord(struct Code * code, word_t value);
+
+ long long runSteps(struct Code * code, StepFunc step, long long max_steps, int * status, char * err_str);
+
+ void stateInit(struct State * st);
+
+ void stateFree(struct State * st);
+
+ void stateFreeValues(struct State * st, word_t * values);
+
+ unsigned int getHash(struct CodeRow * row, int vals);
+
+ int stateAddRow(struct State * st, struct Code * code, int cmd_key, int cmd_ptr);
+
+ int commandOperands(struct Code * code, struct Command * cmd, int * slots);
+
+ int commandTargets(struct Code * code, struct Command * cmd, int * slots);
+
+ int stateRowCommand(struct Code * code, struct CodeRow * row, struct Command * cmd);
+
+ int stateEditCell(struct State * st, struct Code * code, StepFunc step, int row, unsigned int ptr, word_t value, int * cmd_key, int * cmd_ptr, int * rerun_from, int * rerun_to);
+
+#endif
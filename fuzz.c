@@ -0,0 +1,476 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "engine.h"
+#include "fuzz.h"
+#include "stats.h"
+
+#define EDGE_MAP_BITS   (1 << 16)
+#define EDGE_MAP_WORDS  (EDGE_MAP_BITS / 64)
+#define FINDING_SLOTS   8192
+#define EXEC_BATCH      256
+
+struct FuzzShared {
+    struct Code * image;
+    StepFunc step;
+    long long max_steps;
+    const char * out_dir;
+
+    int * inputs;
+    int input_cnt;
+
+    word_t * dict;
+    int dict_cnt;
+
+    unsigned long long edges[EDGE_MAP_WORDS];
+    unsigned long long finding_keys[FINDING_SLOTS];
+
+    pthread_mutex_t lock;
+    word_t * corpus;
+    int corpus_cnt, corpus_cap;
+    int finding_cnt;
+
+    long long execs;
+    int stop;
+};
+
+struct FuzzWorker {
+    struct FuzzShared * fs;
+    struct Code code;
+    unsigned long long rng;
+    unsigned long long map[EDGE_MAP_WORDS];
+    unsigned long long seen[EDGE_MAP_WORDS];
+    pthread_t thread;
+
+    word_t * corpus;
+    int corpus_cnt, corpus_cap;
+    int synced;
+
+    word_t * fresh;
+    unsigned long long * fresh_maps;
+    int fresh_cnt, fresh_cap;
+};
+
+static unsigned long long fuzzRand(unsigned long long * rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static void saveInput(struct FuzzShared * fs, const char * name, const word_t * input)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", fs->out_dir, name);
+
+    FILE * out = fopen(path, "w");
+    if (!out)
+    {
+        fprintf(stderr, "Couldn't open file \"%s\"\n", path);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < fs->input_cnt; ++i)
+    {
+        char value[48];
+        formatWord(value, input[i]);
+        fprintf(out, "%04X = %s\n", fs->image->mem_ptrs[fs->inputs[i]], value);
+    }
+    fclose(out);
+}
+
+static int fuzzExec(struct FuzzWorker * w, const word_t * input, char * err_str, int * fault_row)
+{
+    struct FuzzShared * fs = w->fs;
+    struct Code * code = &w->code;
+
+    codeReset(code, fs->image);
+
+    int i;
+    for (i = 0; i < fs->input_cnt; ++i)
+        code->mem_vals[fs->inputs[i]] = input[i];
+
+    memset(w->map, 0, sizeof(w->map));
+
+    int cmd_i = 0, cmd_ptr = code->mem_start;
+    long long steps;
+
+    STATS_BEGIN(start);
+    STATS_COUNT(STAT_RUNS, 1);
+    for (steps = 0; steps < fs->max_steps; ++steps)
+    {
+        int from = cmd_i;
+        int status = fs->step(code, err_str, &cmd_i, &cmd_ptr);
+        if (status)
+        {
+            STATS_END(STAT_RUN, start);
+            STATS_COUNT(STAT_STEPS, steps + 1);
+            *fault_row = from;
+            return status;
+        }
+
+        unsigned int edge = ((((unsigned int)from << 16) | (unsigned int)cmd_i) * 2654435761u) >> 16;
+        w->map[edge >> 6] |= 1ULL << (edge & 63);
+    }
+
+    STATS_END(STAT_RUN, start);
+    STATS_COUNT(STAT_STEPS, steps);
+    STATS_COUNT(STAT_LIMITS, 1);
+    PROBE_STEP_LIMIT(steps);
+
+    *fault_row = cmd_i;
+    sprintf(err_str, "step limit of %lld exceeded", fs->max_steps);
+    return -2;
+}
+
+static int appendInput(word_t ** inputs, int * cnt, int * cap, const word_t * input, int input_cnt)
+{
+    if (*cnt == *cap)
+    {
+        int new_cap = *cap ? *cap * 2 : 64;
+        word_t * grown = (word_t*) realloc(*inputs, sizeof(word_t) * input_cnt * new_cap);
+        if (!grown)
+            return -1;
+        *inputs = grown;
+        *cap = new_cap;
+    }
+    memcpy(*inputs + (long long)*cnt * input_cnt, input, sizeof(word_t) * input_cnt);
+    (*cnt)++;
+    return 0;
+}
+
+static void addCorpus(struct FuzzShared * fs, const word_t * input)
+{
+    if (appendInput(&fs->corpus, &fs->corpus_cnt, &fs->corpus_cap, input, fs->input_cnt))
+        return;
+
+    char name[64];
+    sprintf(name, "queue-%05d.txt", fs->corpus_cnt);
+    saveInput(fs, name, input);
+}
+
+static void checkCoverage(struct FuzzWorker * w, const word_t * input)
+{
+    struct FuzzShared * fs = w->fs;
+
+    int i, fresh = 0;
+    for (i = 0; i < EDGE_MAP_WORDS; ++i)
+    {
+        if (w->map[i] & ~w->seen[i])
+        {
+            fresh = 1;
+            w->seen[i] |= w->map[i];
+        }
+    }
+
+    if (!fresh || appendInput(&w->corpus, &w->corpus_cnt, &w->corpus_cap, input, fs->input_cnt))
+        return;
+
+    if (w->fresh_cnt == w->fresh_cap)
+    {
+        int cap = w->fresh_cap ? w->fresh_cap * 2 : 16;
+        word_t * inputs = (word_t*) realloc(w->fresh, sizeof(word_t) * fs->input_cnt * cap);
+        if (inputs)
+            w->fresh = inputs;
+        unsigned long long * maps = (unsigned long long*) realloc(w->fresh_maps, sizeof(w->map) * cap);
+        if (maps)
+            w->fresh_maps = maps;
+        if (!inputs || !maps)
+            return;
+        w->fresh_cap = cap;
+    }
+    memcpy(w->fresh + (long long)w->fresh_cnt * fs->input_cnt, input, sizeof(word_t) * fs->input_cnt);
+    memcpy(w->fresh_maps + (long long)w->fresh_cnt * EDGE_MAP_WORDS, w->map, sizeof(w->map));
+    w->fresh_cnt++;
+}
+
+static void syncWorker(struct FuzzWorker * w)
+{
+    struct FuzzShared * fs = w->fs;
+
+    pthread_mutex_lock(&fs->lock);
+
+    for (; w->synced < fs->corpus_cnt; ++w->synced)
+        appendInput(&w->corpus, &w->corpus_cnt, &w->corpus_cap,
+            fs->corpus + (long long)w->synced * fs->input_cnt, fs->input_cnt);
+
+    int k, i;
+    for (k = 0; k < w->fresh_cnt; ++k)
+    {
+        unsigned long long * map = w->fresh_maps + (long long)k * EDGE_MAP_WORDS;
+        int fresh = 0;
+        for (i = 0; i < EDGE_MAP_WORDS; ++i)
+        {
+            if (map[i] & ~fs->edges[i])
+            {
+                fresh = 1;
+                fs->edges[i] |= map[i];
+            }
+        }
+        if (fresh)
+            addCorpus(fs, w->fresh + (long long)k * fs->input_cnt);
+    }
+    w->synced = fs->corpus_cnt;
+    w->fresh_cnt = 0;
+
+    for (i = 0; i < EDGE_MAP_WORDS; ++i)
+        w->seen[i] |= fs->edges[i];
+
+    pthread_mutex_unlock(&fs->lock);
+}
+
+static void recordFinding(struct FuzzWorker * w, const word_t * input, const char * err_str, int fault_row)
+{
+    struct FuzzShared * fs = w->fs;
+
+    char error[128];
+    stripColors(error, err_str, sizeof(error));
+
+    unsigned long long key = 1469598103934665603ULL ^ (unsigned long long)fault_row;
+    const char * c;
+    for (c = error; *c; ++c)
+        key = (key ^ (unsigned char)*c) * 1099511628211ULL;
+    if (!key)
+        key = 1;
+
+    unsigned int slot = (unsigned int)(key % FINDING_SLOTS), probes;
+    for (probes = 0; probes < FINDING_SLOTS; ++probes, slot = (slot + 1) % FINDING_SLOTS)
+    {
+        unsigned long long expected = 0;
+        if (__atomic_compare_exchange_n(fs->finding_keys + slot, &expected, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (expected == key)
+            return;
+    }
+    if (probes == FINDING_SLOTS)
+        return;
+
+    pthread_mutex_lock(&fs->lock);
+    int id = ++fs->finding_cnt;
+
+    char name[64];
+    sprintf(name, "crash-%04d.txt", id);
+    saveInput(fs, name, input);
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/findings.txt", fs->out_dir);
+    FILE * log = fopen(path, "a");
+    if (log)
+    {
+        fprintf(log, "%s\t0x%04X\t%s\n", name, fs->image->mem_start + fault_row, error);
+        fclose(log);
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    printf("\nfinding %s at 0x%04X: %s\n", name, fs->image->mem_start + fault_row, error);
+}
+
+static void mutate(struct FuzzWorker * w, word_t * input)
+{
+    struct FuzzShared * fs = w->fs;
+    struct Code * code = &w->code;
+
+    int rounds = 1 + fuzzRand(&w->rng) % 4;
+    while (rounds--)
+    {
+        int i = fuzzRand(&w->rng) % fs->input_cnt;
+        unsigned long long r = fuzzRand(&w->rng);
+
+        switch (r % 6)
+        {
+            case 0:
+                input[i] = (word_t)fuzzRand(&w->rng);
+                break;
+            case 1:
+                input[i] = (word_t)((uword_t)input[i] + (uword_t)((r >> 8) % 71) - 35);
+                break;
+            case 2:
+                input[i] = (word_t)((uword_t)input[i] ^ ((uword_t)1 << ((r >> 8) % code->word_bits)));
+                break;
+            case 3:
+            {
+                const word_t interesting[4] = {0, 1, -1, 2};
+                int k = (r >> 8) % (fs->dict_cnt + 6);
+                if (k < 4)
+                    input[i] = interesting[k];
+                else if (k < 6)
+                    input[i] = (word_t)(((uword_t)1 << (code->word_bits - 1)) - (k == 4));
+                else input[i] = fs->dict[k - 6];
+                break;
+            }
+            case 4:
+            {
+                int from = (r >> 8) % w->corpus_cnt;
+                input[i] = w->corpus[(long long)from * fs->input_cnt + i];
+                break;
+            }
+            case 5:
+                input[i] = (word_t)(0 - (uword_t)input[i]);
+                break;
+        }
+        input[i] = fitWord(code, input[i]);
+    }
+}
+
+static void * fuzzWorker(void * arg)
+{
+    struct FuzzWorker * w = (struct FuzzWorker*) arg;
+    struct FuzzShared * fs = w->fs;
+
+    word_t * input = (word_t*) malloc(sizeof(word_t) * fs->input_cnt);
+    char err_str[128];
+    int fault_row, execs = 0;
+
+    syncWorker(w);
+    while (!__atomic_load_n(&fs->stop, __ATOMIC_RELAXED))
+    {
+        int parent = fuzzRand(&w->rng) % w->corpus_cnt;
+        memcpy(input, w->corpus + (long long)parent * fs->input_cnt, sizeof(word_t) * fs->input_cnt);
+
+        mutate(w, input);
+
+        if (fuzzExec(w, input, err_str, &fault_row) < 0)
+            recordFinding(w, input, err_str, fault_row);
+        else checkCoverage(w, input);
+
+        if (++execs == EXEC_BATCH)
+        {
+            __atomic_fetch_add(&fs->execs, execs, __ATOMIC_RELAXED);
+            execs = 0;
+            syncWorker(w);
+        }
+    }
+
+    __atomic_fetch_add(&fs->execs, execs, __ATOMIC_RELAXED);
+    syncWorker(w);
+    free(input);
+    return NULL;
+}
+
+static int countEdges(struct FuzzShared * fs)
+{
+    int i, cnt = 0;
+    for (i = 0; i < EDGE_MAP_WORDS; ++i)
+        cnt += __builtin_popcountll(fs->edges[i]);
+    return cnt;
+}
+
+int runFuzz(struct Code * code, const char * out_dir, int threads, int seconds, long long max_steps)
+{
+    struct FuzzShared * fs = (struct FuzzShared*) calloc(1, sizeof(struct FuzzShared));
+    if (!fs)
+        return -1;
+
+    fs->image     = code;
+    fs->step      = selectStep(code);
+    fs->max_steps = max_steps;
+    fs->out_dir   = out_dir;
+
+    fs->inputs = (int*)    malloc(sizeof(int)    * (code->mem_cnt + 1));
+    fs->dict   = (word_t*) malloc(sizeof(word_t) * (code->mem_cnt * 3 + 1));
+
+    int i;
+    for (i = 0; i < code->mem_cnt; ++i)
+    {
+        if (code->mem_vals[i] == INPUT_FLAG)
+        {
+            fs->inputs[fs->input_cnt++] = i;
+            code->mem_vals[i] = 0;
+        }
+        else
+        {
+            fs->dict[fs->dict_cnt++] = code->mem_vals[i];
+            fs->dict[fs->dict_cnt++] = fitWord(code, (word_t)((uword_t)code->mem_vals[i] + 1));
+            fs->dict[fs->dict_cnt++] = fitWord(code, (word_t)((uword_t)code->mem_vals[i] - 1));
+        }
+    }
+
+    if (!fs->input_cnt)
+    {
+        fprintf(stderr, "Program has no input cells to fuzz\n");
+        free(fs->inputs);
+        free(fs->dict);
+        free(fs);
+        return -1;
+    }
+
+    mkdir(out_dir, 0755);
+    pthread_mutex_init(&fs->lock, NULL);
+
+    word_t * seed = (word_t*) calloc(fs->input_cnt, sizeof(word_t));
+    addCorpus(fs, seed);
+    free(seed);
+
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    struct FuzzWorker * workers = (struct FuzzWorker*) calloc(threads, sizeof(struct FuzzWorker));
+
+    printf("Fuzzing %d input cells on %d threads for %d s, results in \"%s\"\n",
+        fs->input_cnt, threads, seconds, out_dir);
+
+    int started = 0;
+    for (i = 0; i < threads; ++i)
+    {
+        workers[i].fs  = fs;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ (unsigned long long)time(NULL);
+        if (codeCpy(code, &workers[i].code))
+            break;
+        if (pthread_create(&workers[i].thread, NULL, fuzzWorker, workers + i))
+        {
+            codeFree(&workers[i].code);
+            break;
+        }
+        started++;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long long last_execs = 0;
+    int elapsed = 0;
+    while (started && elapsed < seconds)
+    {
+        sleep(1);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (int)(now.tv_sec - start.tv_sec);
+
+        long long execs = __atomic_load_n(&fs->execs, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&fs->lock);
+        printf("\r[%4d s] execs: %lld (%lld/s)  corpus: %d  edges: %d  findings: %d   ",
+            elapsed, execs, execs - last_execs, fs->corpus_cnt, countEdges(fs), fs->finding_cnt);
+        pthread_mutex_unlock(&fs->lock);
+        fflush(stdout);
+        last_execs = execs;
+    }
+
+    __atomic_store_n(&fs->stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < started; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+        codeFree(&workers[i].code);
+        free(workers[i].corpus);
+        free(workers[i].fresh);
+        free(workers[i].fresh_maps);
+    }
+
+    printf("\nDone: %lld executions, %d corpus entries, %d edges, %d findings\n",
+        fs->execs, fs->corpus_cnt, countEdges(fs), fs->finding_cnt);
+
+    int findings = fs->finding_cnt;
+
+    pthread_mutex_destroy(&fs->lock);
+    free(workers);
+    free(fs->corpus);
+    free(fs->inputs);
+    free(fs->dict);
+    free(fs);
+    return findings ? 1 : 0;
+}
@@ -0,0 +1,8 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include "code.h"
+
+ int runFuzz(struct Code * code, const char * out_dir, int threads, int seconds, long long max_steps);
+
+#endif
@@ -1,33 +1,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <poll.h>
 #include <termios.h>
-#include "code.h"
+#include "engine.h"
+#include "bench.h"
+#include "fuzz.h"
+#include "server.h"
+#include "aot.h"
+#include "diff.h"
+#include "stats.h"
+#include "query.h"
+#include "session.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define HASH_MOD 10007
 
-const int MAX_STATE_LENGTH    = 1 << 20;
 const int MAX_DISPLAYING_ROWS = 1000;
+const int MAX_DISPLAYING_COLS = 16;
 
-struct CodeRow {
-    int cmd_ptr;
-    int cmd_key;
-    int * values;
-};
+#define MAX_PINNED SESSION_PINNED
 
-struct State {
-    char error[70];
-    struct CodeRow * rows;
-    int * col_sizes;
-    int capacity;
-    int length;
+static unsigned int pinned[MAX_PINNED];
+static int pin_cnt = 0;
 
-    unsigned int rowHashes[HASH_MOD];
-};
+static char session_path[1024] = "";
+static char program_path[1024] = "";
+static int load_flags = 0;
 
-struct Code* runLoad()
+struct Code* runLoad(int flags)
 {
     char file_name[1024];
     printf("Select file: ");
@@ -39,14 +41,22 @@ struct Code* runLoad()
     if (status == NULL)
         return NULL;
 
-    struct Code* code = loadFromFile(file_name);
+    struct Code* code = loadFromFile(file_name, flags);
 
     if (!code)
         return NULL;
+
+    if (!realpath(file_name, program_path))
+        strcpy(program_path, file_name);
     
     return code;
 }
 
+void clearScreen()
+{
+    printf("\033[H\033[2J\033[3J");
+}
+
 void printLine(unsigned char* s, int length)
 {
     while (length-- > 0)
@@ -68,7 +78,7 @@ void printTableBound(int ncols, int * col_sizes, unsigned char* s_start, unsigne
     printf("\n");
 }
 
-int getlen(int number)
+int getlen(word_t number)
 {
     int len = number <= 0;
     while (number)
@@ -79,207 +89,85 @@ int getlen(int number)
     return len;
 }
 
-int * findCell(struct Code * code, unsigned int ptr)
+int cmpInt(const void * a, const void * b)
 {
-    int i;
-    for (i = 0; i < code->mem_cnt; ++i)
-    {
-        if (code->mem_ptrs[i] == ptr)
-            return code->mem_vals + i;
-    }
-    return NULL;
+    return *(const int*)a - *(const int*)b;
 }
 
-int findCommandKey(struct Code * code, int ptr)
+int selectColumns(struct Code * code, struct State * st, int min_row, int max_row, int * cols)
 {
-    int i, cmd_ptr = code->mem_start;
-    for (i = 0; i < code->length; ++i)
+    int i, ncols = 0;
+    if (code->mem_cnt <= MAX_DISPLAYING_COLS)
     {
-        if (cmd_ptr == ptr)
-            return i;
-
-        cmd_ptr += code->rows[i].word_length;
+        for (i = 0; i < code->mem_cnt; ++i)
+            cols[ncols++] = i;
+        return ncols;
     }
 
-    if (cmd_ptr == ptr)
-        return -2;
-
-    return -1;
-}
-
-int runCommand(struct Code * code, char * err_str, int * cmd_i, int * cmd_ptr)
-{
-    struct Command * cmd = code->rows + *cmd_i;
-
-    int * arg1_v = NULL;
-    int * arg2_v = NULL;
-    int * arg3_v = NULL;
-
-    if (cmd->key != 0x99 && (cmd->key < 0x80 || cmd->key >= 0x96))
+    static unsigned char * marks = NULL;
+    static int marks_cap = 0;
+    if (marks_cap < code->mem_cnt)
     {
-        arg3_v = findCell(code, cmd->arg3);
-        if (!arg3_v)
-        {
-            sprintf(err_str, "\x1b[38;2;205;49;49mundefined cell 0x%04X\033[0m", cmd->arg3);
-            return -1;
-        }
+        marks = (unsigned char*) realloc(marks, code->mem_cnt);
+        memset(marks, 0, code->mem_cnt);
+        marks_cap = code->mem_cnt;
     }
 
-    if (cmd->key != 0x99 && cmd->key != 0x80)
+    int slots[4];
+    for (i = 0; i < pin_cnt; ++i)
     {
-        arg1_v = findCell(code, cmd->arg1);
-        if (!arg1_v)
+        slots[0] = code->cell_slots[pinned[i]];
+        if (slots[0] >= 0 && slots[0] < code->mem_cnt && !marks[slots[0]])
         {
-            sprintf(err_str, "\x1b[38;2;205;49;49mundefined cell 0x%04X\033[0m", cmd->arg1);
-            return -1;
+            marks[slots[0]] = 1;
+            cols[ncols++] = slots[0];
         }
     }
 
-    if (cmd->key != 0x99 && cmd->key != 0x80 && cmd->key != 0x00)
+    int row_i;
+    for (row_i = min_row; row_i < max_row && row_i < st->length; ++row_i)
     {
-        arg2_v = findCell(code, cmd->arg2);
-        if (!arg2_v)
-        {
-            sprintf(err_str, "\x1b[38;2;205;49;49mundefined cell 0x%04X\033[0m", cmd->arg2);
-            return -1;
-        }
-    }
+        struct Command cmd;
+        stateRowCommand(code, st->rows + row_i, &cmd);
+        int cnt = commandOperands(code, &cmd, slots);
+        cnt += commandTargets(code, &cmd, slots + cnt);
 
-    switch (cmd->key)
-    {
-        case 0x99:
-        {
-            sprintf(err_str, "\x1b[38;2;44;124;237msuccessfully finished\033[0m");
-            return 1;
-        }
-        case 0x00:
-        {
-            *arg3_v = *arg1_v;
-            (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x01:
-        {
-            *arg3_v = *arg1_v + *arg2_v;
-            (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x02:
-        {
-            *arg3_v = *arg1_v - *arg2_v;
-            (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x03:
-        case 0x13:
+        for (i = 0; i < cnt; ++i)
         {
-            *arg3_v = *arg1_v * *arg2_v;
-            (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x04:
-        case 0x14:
-        {
-            int * arg4_v = findCell(code, cmd->arg3 + 1);
-
-            if (*arg2_v == 0)
+            if (slots[i] < code->mem_cnt && !marks[slots[i]])
             {
-                sprintf(err_str, "\x1b[38;2;205;49;49mtrying to divide by zero\033[0m");
-                return -1;
+                marks[slots[i]] = 1;
+                cols[ncols++] = slots[i];
             }
-
-            int del =  *arg1_v / *arg2_v;
-            int mod =  *arg1_v - *arg2_v * del;
-
-            *arg3_v = del;
-            if (arg4_v)
-                *arg4_v = mod;
-            
-            (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x80:
-        {
-            (*cmd_ptr) = cmd->arg3;
-            break;
-        }
-        case 0x81:
-        {
-            if (*arg1_v == *arg2_v)
-                (*cmd_ptr) = cmd->arg3;
-            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x82:
-        {
-            if (*arg1_v != *arg2_v)
-                (*cmd_ptr) = cmd->arg3;
-            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x83:
-        case 0x93:
-        {
-            if (*arg1_v < *arg2_v)
-                (*cmd_ptr) = cmd->arg3;
-            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x84:
-        case 0x94:
-        {
-            if (*arg1_v >= *arg2_v)
-                (*cmd_ptr) = cmd->arg3;
-            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x85:
-        case 0x95:
-        {
-            if (*arg1_v > *arg2_v)
-                (*cmd_ptr) = cmd->arg3;
-            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
-        }
-        case 0x86:
-        case 0x96:
-        {
-            if (*arg1_v <= *arg2_v)
-                (*cmd_ptr) = cmd->arg3;
-            else (*cmd_ptr) += code->rows[*cmd_i].word_length;
-            break;
         }
     }
 
-    *cmd_i = findCommandKey(code, *cmd_ptr);
-    if (*cmd_i == -1)
-    {
-        sprintf(err_str, "\x1b[38;2;205;49;49mno command at cell 0x%04X\033[0m", *cmd_ptr);
-        return -1;
-    }
-    else if (*cmd_i == -2)
-    {
-        sprintf(err_str, "\x1b[38;2;205;49;49mforced to terminate at 0x%04X\033[0m", *cmd_ptr);
-        return -1;
-    }
+    for (i = 0; i < ncols; ++i)
+        marks[cols[i]] = 0;
 
-    return 0;
+    qsort(cols, ncols, sizeof(int), cmpInt);
+    return ncols;
 }
 
 void drawCode(struct Code * code, struct State st, int is_full, int active_row, int is_err)
 {
-    const int HINT_SIZE = 7;
-    char hint_array[7][70] = {
+    const int HINT_SIZE = 11;
+    char hint_array[11][70] = {
         "Use keyboard to:",
-        "(1) <enter> - move forward",
-        "(2) <backspace> move back",
+        "(1) <enter> - move forward, '500<enter>' - 500 steps",
+        "(2) <backspace> move back, counts work here too",
         "(3) 'v' - to change view modes (default/full)",
         "(4) 'r' - to execute the whole program without stopping",
         "(5) 't' - to reset the program",
-        "(6) 'e' - to exit the program"
+        "(6) 'e' - to exit the program",
+        "(7) 'c' - to change a cell value at the current row",
+        "(8) 'p' - to pin or unpin a cell column",
+        "(9) 'f' - to find a row like '[FF00] < 0', 'n' - next match",
+        "(10) 's' - to save the session, resume it with --session FILE"
     };
 
-    system("clear");
+    STATS_BEGIN(start);
+    clearScreen();
 
     if (!is_full)
     {
@@ -289,6 +177,9 @@ void drawCode(struct Code * code, struct State st, int is_full, int active_row,
         printf("\n\x1b[38;2;250;180;25m");
         for (i = 0; i < code->length; ++i)
         {
+            if (code->unified)
+                fetchCommand(code, i);
+
             if (st.rows[active_row].cmd_key == i)
                 printf("\033[1;97m");
             printf("%02X %04X %04X %04X", 
@@ -321,18 +212,6 @@ void drawCode(struct Code * code, struct State st, int is_full, int active_row,
     printf("\n\n");
 
 
-    printTableBound(code->mem_cnt + 1, st.col_sizes, "╔", "╦", "╗", "═");
-    printf("║ \033[1;97mCommand\033[0m");
-    printLine(" ", st.col_sizes[0] - 9);
-
-    int mem_i;
-    for (mem_i = 0; mem_i < code->mem_cnt; ++mem_i)
-    {
-        printf(" ║ 0x%04X", code->mem_ptrs[mem_i]);
-        printLine(" ", st.col_sizes[mem_i + 1] - 8);
-    }
-    printf(" ║\n");
-
     int row_i;
 
     static int last_bound = 0;
@@ -345,18 +224,45 @@ void drawCode(struct Code * code, struct State st, int is_full, int active_row,
     int min_row = is_full ? 0 : MAX(last_bound, 0);
     int max_row = is_full ? st.length : MAX(10, MIN(st.length, last_bound + 10));
 
+    int * cols   = (int*) malloc(sizeof(int) * (code->mem_cnt + 1));
+    int ncols    = selectColumns(code, &st, min_row, max_row, cols);
+    int * widths = (int*) malloc(sizeof(int) * (ncols + 1));
+
+    int col_i;
+    widths[0] = st.col_sizes[0];
+    for (col_i = 0; col_i < ncols; ++col_i)
+        widths[col_i + 1] = st.col_sizes[cols[col_i] + 1];
+
+    if (ncols < code->mem_cnt)
+        printf("Cells: %d of %d shown (used near the cursor and pinned)\n\n", ncols, code->mem_cnt);
+
+    printTableBound(ncols + 1, widths, "╔", "╦", "╗", "═");
+    printf("║ \033[1;97mCommand\033[0m");
+    printLine(" ", widths[0] - 9);
+
+    for (col_i = 0; col_i < ncols; ++col_i)
+    {
+        printf(" ║ 0x%04X", code->mem_ptrs[cols[col_i]]);
+        printLine(" ", widths[col_i + 1] - 8);
+    }
+    printf(" ║\n");
+
     for (row_i = min_row; row_i < max_row; row_i++)
     {
-        printTableBound(code->mem_cnt + 1, st.col_sizes, "╠", "╬", "╣", "═");
+        printTableBound(ncols + 1, widths, "╠", "╬", "╣", "═");
 
         if (row_i < st.length)
         {
+            struct Command cmd;
+            stateRowCommand(code, st.rows + row_i, &cmd);
+
             printf("║ 0x%04X : ", st.rows[row_i].cmd_ptr);
-            printCommand(code->rows[st.rows[row_i].cmd_key], stdout);
-            printLine(" ", st.col_sizes[0] - 28);
+            printCommand(cmd, stdout);
+            printLine(" ", widths[0] - 28);
             
-            for (mem_i = 0; mem_i < code->mem_cnt; ++mem_i)
+            for (col_i = 0; col_i < ncols; ++col_i)
             {
+                int mem_i = cols[col_i];
                 printf(" ║ ");
                 int len = getlen(st.rows[row_i].values[mem_i]);
 
@@ -365,8 +271,10 @@ void drawCode(struct Code * code, struct State st, int is_full, int active_row,
                 else printf("\033[1;97m");
 
 
-                printf("%d\033[0m", st.rows[row_i].values[mem_i]);
-                printLine(" ", st.col_sizes[mem_i + 1] - len - 2);
+                char value[48];
+                formatWord(value, st.rows[row_i].values[mem_i]);
+                printf("%s\033[0m", value);
+                printLine(" ", widths[col_i + 1] - len - 2);
             }
             printf(" ║");
             
@@ -376,163 +284,511 @@ void drawCode(struct Code * code, struct State st, int is_full, int active_row,
                 printf("\x1b[38;2;205;49;49m Error!\033[0m");
             printf("\n");
         }
-        else printTableBound(code->mem_cnt + 1, st.col_sizes, "║", "║", "║", " ");
+        else printTableBound(ncols + 1, widths, "║", "║", "║", " ");
     }
 
-    printTableBound(code->mem_cnt + 1, st.col_sizes, "╚", "╩", "╝", "═");
+    printTableBound(ncols + 1, widths, "╚", "╩", "╝", "═");
+
+    free(cols);
+    free(widths);
+    STATS_END(STAT_DRAW, start);
+}
+
+static struct termios saved_term;
+static int term_saved = 0;
+
+static unsigned char key_buf[256];
+static int key_len = 0, key_pos = 0;
+
+void termRestore()
+{
+    if (term_saved)
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_term);
+}
+
+void termRaw()
+{
+    if (!term_saved)
+        return;
+
+    struct termios raw = saved_term;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN]  = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+}
+
+void onSignal(int sig)
+{
+    termRestore();
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-unsigned int getHash(struct CodeRow * row, int vals)
+void termInit()
 {
-    unsigned int hash = (row->cmd_ptr * 997) % HASH_MOD;
-    for (int i = 0; i < vals; ++i)
+    if (tcgetattr(STDIN_FILENO, &saved_term))
+        return;
+
+    term_saved = 1;
+    atexit(termRestore);
+    signal(SIGINT,  onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGHUP,  onSignal);
+    signal(SIGQUIT, onSignal);
+    termRaw();
+}
+
+int fillKeys(int timeout)
+{
+    if (key_pos < key_len)
+        return 1;
+
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout) <= 0)
+        return 0;
+
+    ssize_t n = read(STDIN_FILENO, key_buf, sizeof(key_buf));
+    if (n <= 0)
+        return -1;
+
+    key_len = n;
+    key_pos = 0;
+    return 1;
+}
+
+int getKey()
+{
+    fflush(stdout);
+    if (fillKeys(-1) <= 0)
+        return EOF;
+    return key_buf[key_pos++];
+}
+
+int peekKey()
+{
+    if (fillKeys(0) <= 0)
+        return EOF;
+    return key_buf[key_pos];
+}
+
+int keyCommand(int key)
+{
+    if (key == 10)
+        return 1;
+    if (key == 101 || key == 69)
+        return 2;
+    if (key == 127)
+        return 3;
+    if (key == 118 || key == 86)
+        return 4;
+    if (key == 114 || key == 82)
+        return 5;
+    if (key == 116 || key == 84)
+        return 6;
+    if (key == 99 || key == 67)
+        return 7;
+    if (key == 112 || key == 80)
+        return 8;
+    if (key == 102 || key == 70)
+        return 9;
+    if (key == 110 || key == 78)
+        return 10;
+    if (key == 115 || key == 83)
+        return 11;
+    return 0;
+}
+
+int waitCommand(long long * count)
+{
+    long long prefix = 0;
+    while (1)
     {
-        hash = (hash * 997 + 10 * row->values[i]) % HASH_MOD;
+        int key = getKey();
+        if (key == EOF)
+            return 2;
+
+        if (key >= '0' && key <= '9' && (prefix || key != '0'))
+        {
+            if (prefix < MAX_STATE_LENGTH)
+                prefix = prefix * 10 + key - '0';
+            continue;
+        }
+
+        int cmd_code = keyCommand(key);
+        if (!cmd_code)
+        {
+            prefix = 0;
+            continue;
+        }
+
+        *count = prefix ? prefix : 1;
+        if (cmd_code == 1 || cmd_code == 3)
+        {
+            while (peekKey() == key)
+            {
+                key_pos++;
+                (*count)++;
+            }
+        }
+        return cmd_code;
     }
 
-    return hash % HASH_MOD;
+    return 0;
 }
 
-int stateAddRow(struct State * st, struct Code * code, int cmd_key, int cmd_ptr)
+int readLine(char * line, int size)
 {
-    if (st->capacity == st->length)
+    int len = 0;
+    while (1)
     {
-        st->capacity = (st->capacity == 0) ? code->length : st->capacity * 2;
-        st->rows = (struct CodeRow *)realloc(st->rows, sizeof(struct CodeRow) * st->capacity);
+        int key = getKey();
+        if (key == EOF)
+            return -1;
+        if (key == '\n' || key == '\r')
+            break;
+
+        if (key == 127 || key == 8)
+        {
+            if (len > 0)
+            {
+                len--;
+                printf("\b \b");
+            }
+        }
+        else if (len + 1 < size && key >= ' ')
+        {
+            line[len++] = key;
+            putchar(key);
+        }
     }
-    st->rows[st->length].cmd_key = cmd_key;
-    st->rows[st->length].cmd_ptr = cmd_ptr;
 
-    st->rows[st->length].values = (int*) malloc(sizeof(int) * code->mem_cnt);
-    memcpy(st->rows[st->length].values, code->mem_vals, sizeof(int) * code->mem_cnt);
+    line[len] = '\0';
+    printf("\n");
+    return 0;
+}
 
-    unsigned int h = getHash(&st->rows[st->length], code->mem_cnt);
+int promptWord(word_t * value)
+{
+    char line[64];
+    if (readLine(line, sizeof(line)))
+        return -1;
+
+    FILE * stream = fmemopen(line, strlen(line) + 1, "r");
+    if (!stream)
+        return -1;
 
-    st->length++;
+    int status = scanWord(stream, value);
+    fclose(stream);
+    return status;
+}
 
-    if (st->length >= MAX_STATE_LENGTH)
+void promptInputs(struct Code * code)
+{
+    int i;
+    for (i = 0; i < code->mem_cnt; ++i)
     {
-        sprintf(st->error, "\x1b[38;2;205;49;49mstopped after %d'th row\033[0m", st->length);
-        return -1;
+        if (code->mem_vals[i] == INPUT_FLAG)
+        {
+            printf("Input to 0x%04X: ", code->mem_ptrs[i]);
+            fflush(stdout);
+            if (promptWord(code->mem_vals + i))
+                code->mem_vals[i] = 0;
+            code->mem_vals[i] = fitWord(code, code->mem_vals[i]);
+        }
     }
+}
 
-    if (st->rowHashes[h])
+void readInputs(struct Code * code)
+{
+    int i;
+    for (i = 0; i < code->mem_cnt; ++i)
     {
-        int is_eq = st->rows[st->rowHashes[h] - 1].cmd_ptr == st->rows[st->length - 1].cmd_ptr;
-        for (int i = 0; i < code->mem_cnt; ++i)
+        if (code->mem_vals[i] == INPUT_FLAG)
         {
-            is_eq &= (st->rows[st->rowHashes[h] - 1].values[i] == st->rows[st->length - 1].values[i]);
+            printf("Input to 0x%04X: ", code->mem_ptrs[i]);
+            scanWord(stdin, code->mem_vals + i);
+            code->mem_vals[i] = fitWord(code, code->mem_vals[i]);
         }
+    }
+}
 
-        if (is_eq)
-        {
-            sprintf(st->error, "\x1b[38;2;205;49;49minfinite loop found : rows [0x%04X - 0x%04X]\033[0m", 
-            st->rows[st->rowHashes[h] - 1].cmd_ptr, 
-            st->rows[st->length - 1].cmd_ptr
-            );
+int runHeadless(struct Code * code, int use_aot, long long max_steps)
+{
+    readInputs(code);
+
+    char err_str[128] = "";
+    int status = 0;
+    long long steps;
+
+    if (use_aot && code->unified)
+        fprintf(stderr, "Self-modifying (unified) programs can't be compiled ahead of time, interpreting\n");
+
+    if (use_aot && !code->unified)
+    {
+        struct AotProgram * prog = aotLoad(code);
+        if (!prog)
+            return -1;
+        steps = aotRun(prog, code, max_steps, &status, err_str);
+        aotClose(prog);
+    }
+    else steps = runSteps(code, selectStep(code), max_steps, &status, err_str);
+
+    if (!status)
+        sprintf(err_str, "stopped after %lld steps", steps);
+    printf("%s\nsteps: %lld\n", err_str, steps);
+
+    int i;
+    for (i = 0; i < code->mem_cnt; ++i)
+    {
+        char value[48];
+        formatWord(value, code->mem_vals[i]);
+        printf("0x%04X = %s\n", code->mem_ptrs[i], value);
+    }
+    return status < 0 ? -1 : 0;
+}
 
-            st->rowHashes[h] = st->length;
+int runDiffMode(struct Code * code, const char * other_path, int flags, int word_bits, int saturate, long long max_steps)
+{
+    struct Code other;
+
+    if (other_path)
+    {
+        struct Code * loaded = loadFromFile(other_path, flags);
+        if (!loaded)
             return -1;
+        if (setWordWidth(loaded, word_bits, saturate) || codeCpy(loaded, &other))
+        {
+            codeDtor(loaded);
+            return -1;
+        }
+        codeDtor(loaded);
+    }
+    else if (codeCpy(code, &other))
+        return -1;
+
+    printf("Run A:\n");
+    readInputs(code);
+    printf("Run B:\n");
+    readInputs(&other);
+
+    int status = runDiff(code, &other, max_steps);
+    codeFree(&other);
+    return status;
+}
+
+int editCell(struct Code * code, struct State * st, StepFunc step, int row, int * cmd_key, int * cmd_ptr, int is_finished)
+{
+    char line[64];
+    printf("Cell to change at row %d: 0x", row);
+    if (readLine(line, sizeof(line)))
+        return is_finished;
+
+    unsigned int ptr = strtoul(line, NULL, 16);
+    if (ptr >= MEM_SIZE || code->cell_slots[ptr] < 0)
+    {
+        printf("No cell at 0x%04X\n", ptr);
+        getKey();
+        return is_finished;
+    }
+
+    word_t value;
+    printf("New value: ");
+    if (promptWord(&value))
+        return is_finished;
+
+    int rerun_from, rerun_to;
+    value = fitWord(code, value);
+    is_finished = stateEditCell(st, code, step, row, ptr, value, cmd_key, cmd_ptr, &rerun_from, &rerun_to);
+
+    int mem_i = code->cell_slots[ptr];
+    if (mem_i < code->mem_cnt)
+        st->col_sizes[mem_i + 1] = MAX(st->col_sizes[mem_i + 1], getlen(value) + 2);
+
+    int row_i;
+    for (row_i = rerun_from; row_i < rerun_to; ++row_i)
+    {
+        struct Command cmd;
+        if (stateRowCommand(code, st->rows + row_i - 1, &cmd))
+            continue;
+
+        int slots[2], cnt = commandTargets(code, &cmd, slots);
+        while (cnt--)
+        {
+            mem_i = slots[cnt];
+            if (mem_i < code->mem_cnt)
+                st->col_sizes[mem_i + 1] = MAX(st->col_sizes[mem_i + 1], getlen(st->rows[row_i].values[mem_i]) + 2);
+        }
+    }
+
+    return is_finished;
+}
+
+void pinCell(struct Code * code)
+{
+    char line[64];
+    printf("Cell to pin or unpin: 0x");
+    if (readLine(line, sizeof(line)))
+        return;
+
+    unsigned int ptr = strtoul(line, NULL, 16);
+    int i;
+    for (i = 0; i < pin_cnt; ++i)
+    {
+        if (pinned[i] == ptr)
+        {
+            pinned[i] = pinned[--pin_cnt];
+            return;
         }
     }
 
-    st->rowHashes[h] = st->length;
+    if (ptr < MEM_SIZE && code->cell_slots[ptr] >= 0 && pin_cnt < MAX_PINNED)
+        pinned[pin_cnt++] = ptr;
+}
+
+int promptQuery(struct Code * code, struct Query * q, char * notice)
+{
+    char line[128], err_str[128];
+    printf("Find: ");
+    if (readLine(line, sizeof(line)) || !line[0])
+        return -1;
+
+    struct Query parsed;
+    if (queryParse(&parsed, code, line, err_str))
+    {
+        sprintf(notice, "Invalid query: %s", err_str);
+        return -1;
+    }
+    *q = parsed;
     return 0;
 }
 
-int getKey()
+int findRow(struct State * st, struct Trace * tr, struct Query * q, int active_row, char * notice)
 {
-    struct termios oldt,
-    newt;
-    int ch;
-    tcgetattr( STDIN_FILENO, &oldt );
-    newt = oldt;
-    newt.c_lflag &= ~( ICANON | ECHO );
-    tcsetattr( STDIN_FILENO, TCSANOW, &newt );
-    ch = getchar();
-    tcsetattr( STDIN_FILENO, TCSANOW, &oldt );
-    return ch;
+    if (traceSync(tr, q, st))
+    {
+        sprintf(notice, "Couldn't allocate memory for search");
+        return active_row;
+    }
+
+    long long row = queryFind(q, tr, active_row + 1, tr->length);
+    if (row < 0)
+        row = queryFind(q, tr, 0, active_row + 1);
+
+    if (row < 0)
+    {
+        sprintf(notice, "No row of %d matches", st->length);
+        return active_row;
+    }
+
+    sprintf(notice, "Row %lld matches (%lld of %d rows)", row, queryCount(q, tr), st->length);
+    return row;
 }
 
-int waitCommand()
+int saveSession(struct Code * code, struct State * st, struct SessionView * view, char * notice)
 {
-    while (1)
+    if (!session_path[0])
     {
-        int cmd_key = getKey();
-        if (cmd_key == 10)
-            return 1;
-        if (cmd_key == 101 || cmd_key == 69)
-            return 2;
-        if (cmd_key == 127)
-            return 3;
-        if (cmd_key == 118 || cmd_key == 86)
-            return 4;
-        if (cmd_key == 114 || cmd_key == 82)
-            return 5;
-        if (cmd_key == 116 || cmd_key == 84)
-            return 6;
+        printf("Save session to: ");
+        if (readLine(session_path, sizeof(session_path)) || !session_path[0])
+        {
+            session_path[0] = '\0';
+            return -1;
+        }
     }
 
+    view->pin_cnt = pin_cnt;
+    memcpy(view->pinned, pinned, sizeof(unsigned int) * pin_cnt);
+    if (view->active_row < 0)
+        view->active_row = 0;
+
+    if (sessionSave(session_path, program_path, load_flags, code, st, view))
+    {
+        snprintf(notice, 192, "Couldn't save session to %.150s", session_path);
+        return -1;
+    }
+    snprintf(notice, 192, "Session saved to %.150s", session_path);
     return 0;
 }
 
-int runCode(struct Code * code)
+int runCode(struct Code * code, struct State * resumed, struct SessionView * view)
 {
     struct State st;
-    st.length   = 0;
-    st.capacity = 0;
-    st.rows  = NULL;
-    st.error[0] = '\0';
 
-    memset(st.rowHashes, 0, sizeof(unsigned int) * HASH_MOD);
-    
     int active_row  = -1;
     int is_full     = 0;
     int is_finished = 0;
     int is_running  = 0;
 
-    st.col_sizes = (int*) malloc(sizeof(int ) * code->mem_cnt + 1);
+    struct Trace trace;
+    struct Query query;
+    int has_query = 0;
+    char notice[192] = "";
+    traceInit(&trace, code);
 
+    int cmd_key = 0, cmd_ptr = code->mem_start;
 
-    st.col_sizes[0] = 30;
+    StepFunc step = selectStep(code);
 
-    int i;
-    for (i = 0; i < code->mem_cnt; ++i)
+    if (resumed)
     {
-        st.col_sizes[i + 1] = 8;
+        st          = *resumed;
+        active_row  = view->active_row;
+        is_full     = view->is_full;
+        is_finished = view->is_finished;
+        cmd_key     = view->cmd_key;
+        cmd_ptr     = view->cmd_ptr;
 
-        if (code->mem_vals[i] == INPUT_FLAG)
-        {
-            printf("Input to 0x%04X: ", code->mem_ptrs[i]);
-            scanf("%d", code->mem_vals + i);
-        }
+        pin_cnt = view->pin_cnt;
+        memcpy(pinned, view->pinned, sizeof(unsigned int) * pin_cnt);
+
+        drawCode(code, st, is_full, active_row, is_finished == -1);
     }
+    else
+    {
+        stateInit(&st);
+        st.col_sizes = (int*) malloc(sizeof(int) * (code->mem_cnt + 1));
 
-    int cmd_key = 0, cmd_ptr = code->mem_start;
 
-    stateAddRow(&st, code, cmd_key, cmd_ptr);
+        st.col_sizes[0] = 30;
+
+        promptInputs(code);
+
+        int i;
+        for (i = 0; i < code->mem_cnt; ++i)
+            st.col_sizes[i + 1] = MAX(8, getlen(code->mem_vals[i]) + 2);
+
+        stateAddRow(&st, code, cmd_key, cmd_ptr);
+        STATS_COUNT(STAT_RUNS, 1);
+        PROBE_RUN_START(code->length);
+    }
 
     while (1)
     {
-        int cmd_code = is_running ? 1 : waitCommand();
+        long long count = 1;
+        int cmd_code = is_running ? 1 : waitCommand(&count);
         if (cmd_code != 1)
         {
             if (cmd_code == 2)
             {
+                struct SessionView exit_view = { active_row, is_full, is_finished, cmd_key, cmd_ptr };
+                if (session_path[0])
+                    saveSession(code, &st, &exit_view, notice);
+
                 strcpy(st.error, "\x1b[38;2;205;49;49mstopped\033[0m");
                 drawCode(code, st, is_full, active_row, 0);
                 printf("exit\n");
+                if (notice[0])
+                    printf("%s\n", notice);
 
-                for (i = 0; i < st.length; ++i)
-                    free(st.rows[i].values);
-                free(st.rows);
-                free(st.col_sizes);
+                traceFree(&trace);
+                stateFree(&st);
                 return 0;
             }
             if (cmd_code == 3)
             {
                 if (active_row > 0)
-                    active_row--;
+                    active_row = MAX(active_row - count, 0);
             }
             if (cmd_code == 4)
             {
@@ -559,38 +815,69 @@ int runCode(struct Code * code)
 
                 if (ans == 'y' || ans == 'Y')
                 {
-                    for (i = 0; i < st.length; ++i)
-                        free(st.rows[i].values);
-                    free(st.rows);
-                    free(st.col_sizes);
-                    system("clear");
+                    traceFree(&trace);
+                    stateFree(&st);
+                    clearScreen();
                     return 1;
                 }
             }
-        }
-        else if (!is_finished || active_row + 1 < st.length)
-            active_row++;
-
-        if (!is_finished && active_row == st.length)
-        {
-            if (is_finished = runCommand(code, st.error, &cmd_key, &cmd_ptr))
+            if (cmd_code == 7)
             {
+                if (active_row < 0)
+                    active_row = 0;
+                is_finished = editCell(code, &st, step, active_row, &cmd_key, &cmd_ptr, is_finished);
                 is_running  = 0;
-                active_row = st.length - 1;
+                traceTruncate(&trace, active_row);
             }
-            else
+            if (cmd_code == 8)
+                pinCell(code);
+            if (cmd_code == 9 && !promptQuery(code, &query, notice))
             {
-                if(is_finished = stateAddRow(&st, code, cmd_key, cmd_ptr))
+                has_query  = 1;
+                active_row = findRow(&st, &trace, &query, active_row, notice);
+            }
+            if (cmd_code == 10 && has_query)
+                active_row = findRow(&st, &trace, &query, active_row, notice);
+            if (cmd_code == 11)
+            {
+                struct SessionView save_view = { active_row, is_full, is_finished, cmd_key, cmd_ptr };
+                saveSession(code, &st, &save_view, notice);
+            }
+        }
+        else while (count-- > 0 && (!is_finished || active_row + 1 < st.length))
+        {
+            active_row++;
+
+            if (!is_finished && active_row == st.length)
+            {
+                int prev_key = cmd_key;
+
+                STATS_BEGIN(start);
+                is_finished = step(code, st.error, &cmd_key, &cmd_ptr);
+                STATS_END(STAT_RUN, start);
+                STATS_COUNT(STAT_STEPS, 1);
+
+                if (is_finished)
                 {
-                    is_running = 0;
+                    PROBE_RUN_FINISH(st.length, is_finished);
+                    is_running  = 0;
+                    active_row = st.length - 1;
                 }
-
-                int mem_i;
-                for (mem_i = 0; mem_i < code->mem_cnt; ++mem_i)
+                else
                 {
-                    if (getlen(st.rows[active_row].values[mem_i]) + 2 > st.col_sizes[mem_i + 1])
+                    if(is_finished = stateAddRow(&st, code, cmd_key, cmd_ptr))
                     {
-                        st.col_sizes[mem_i + 1] = getlen(st.rows[active_row].values[mem_i]) + 2;
+                        is_running = 0;
+                    }
+
+                    int slots[2], cnt = commandTargets(code, code->rows + prev_key, slots);
+                    while (cnt--)
+                    {
+                        int mem_i = slots[cnt];
+                        if (mem_i < code->mem_cnt && getlen(st.rows[active_row].values[mem_i]) + 2 > st.col_sizes[mem_i + 1])
+                        {
+                            st.col_sizes[mem_i + 1] = getlen(st.rows[active_row].values[mem_i]) + 2;
+                        }
                     }
                 }
             }
@@ -599,66 +886,255 @@ int runCode(struct Code * code)
         if (!is_running)
             drawCode(code, st, is_full, active_row, is_finished == -1);
 
+        if (!is_running && notice[0])
+        {
+            printf("%s\n", notice);
+            notice[0] = '\0';
+        }
+
     }
 
-    for (i = 0; i < st.length; ++i)
-        free(st.rows[i].values);
-    free(st.rows);
-    free(st.col_sizes);
+    stateFree(&st);
     return 0;
 }
 
-int codeCpy(struct Code * code, struct Code * dest)
+void printUsage(FILE * out)
 {
-    dest->capacity  = code->capacity;
-    dest->length    = code->length;
+    fprintf(out,
+        "Usage: um3 [options] [program] [program2]\n"
+        "  -u, --unified          code and data share memory (self-modifying programs)\n"
+        "  -w, --width N          word width in bits, 2..%d in this build\n"
+        "                         (widths up to 128 need a build with -DUM3_WIDE_WORDS)\n"
+        "  -s, --saturate         saturate instead of wrapping on overflow\n"
+        "  --run                  run headless and print the final memory\n"
+        "  --aot                  run headless through the ahead-of-time backend\n"
+        "  --steps N              stop headless runs after N steps (default %d,\n"
+        "                         %lld for --query, 100000 per --fuzz input)\n"
+        "  --diff [program2]      run two programs (or two input sets) in lockstep\n"
+        "  --query EXPR           run headless and list rows matching EXPR\n"
+        "  --session FILE         resume FILE, or save the session there on exit\n"
+        "  --bench [FILE]         run the benchmark suite\n"
+        "  --bench-compare A B    compare two benchmark results\n"
+        "  --threshold PCT        regression threshold for --bench-compare\n"
+        "  --fuzz                 fuzz the program inputs\n"
+        "  -j N                   worker threads for --fuzz and --serve\n"
+        "  --time SEC             fuzzing time\n"
+        "  --out DIR              fuzzing output directory\n"
+        "  --serve SOCKET         serve execution requests on a Unix socket\n"
+        "  --cache N              programs kept by the server\n"
+        "  --stats                print phase timings at exit\n"
+        "  --stats-out FILE       write phase timings as TSV\n",
+        (int)WORD_MAX_BITS, MAX_STATE_LENGTH, QUERY_MAX_STEPS);
+}
 
-    dest->mem_start = code->mem_start;
-    dest->mem_cnt   = code->mem_cnt;
-    dest->mem_cap   = code->mem_cap;
+int main(int argc, char ** argv)
+{
+    int flags = 0;
+    int word_bits = 64, saturate = 0;
 
-    dest->rows   = (struct Command*)malloc(sizeof(struct Command) * dest->capacity);
-    dest->mem_ptrs = (unsigned int*)malloc(sizeof(unsigned int) * dest->mem_cap);
-    dest->mem_vals =          (int*)malloc(sizeof(         int) * dest->mem_cap);
+    int bench = 0;
+    const char * bench_out  = NULL;
+    const char * bench_base = NULL;
+    double threshold = 10;
 
-    if (!dest->rows || !dest->mem_ptrs || !dest->mem_vals)
-        return -1;
+    int fuzz = 0, threads = 0, seconds = 60;
+    long long max_steps = -1;
+    int headless = 0, use_aot = 0;
+    const char * out_dir = "fuzz-out";
+    const char * path = NULL;
 
-    void* err = memcpy(dest->rows, code->rows, sizeof(struct Command) * dest->length);
-    if (err != dest->rows) 
-        return -1;
+    int diff = 0;
+    const char * diff_path = NULL;
 
-    err = memcpy(dest->mem_ptrs, code->mem_ptrs, sizeof(unsigned int) * dest->mem_cnt);
-    if (err != dest->mem_ptrs) 
-        return -1;
+    const char * query_text = NULL;
+    const char * session_arg = NULL;
 
-    err = memcpy(dest->mem_vals, code->mem_vals, sizeof(         int) * dest->mem_cnt);
-    if (err != dest->mem_vals) 
-        return -1;
+    int stats = 0;
+    const char * stats_out = NULL;
 
-    return 0;
-}
+    const char * socket_path = NULL;
+    int cache_size = 64;
 
-int main()
-{
-    struct Code* loaded_code = runLoad();
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--unified"))
+            flags |= LOAD_UNIFIED;
+        else if ((!strcmp(argv[i], "-w") || !strcmp(argv[i], "--width")) && i + 1 < argc)
+            word_bits = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--saturate"))
+            saturate = 1;
+        else if (!strcmp(argv[i], "--bench"))
+        {
+            bench = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                bench_out = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--bench-compare") && i + 2 < argc)
+        {
+            bench_base = argv[++i];
+            bench_out  = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--fuzz"))
+            fuzz = 1;
+        else if (!strcmp(argv[i], "--run"))
+            headless = 1;
+        else if (!strcmp(argv[i], "--aot"))
+            headless = use_aot = 1;
+        else if (!strcmp(argv[i], "--diff"))
+            diff = 1;
+        else if (!strcmp(argv[i], "--session") && i + 1 < argc)
+            session_arg = argv[++i];
+        else if (!strcmp(argv[i], "--query") && i + 1 < argc)
+            query_text = argv[++i];
+        else if (!strcmp(argv[i], "--stats"))
+            stats = 1;
+        else if (!strcmp(argv[i], "--stats-out") && i + 1 < argc)
+            stats_out = argv[++i];
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--time") && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--steps") && i + 1 < argc)
+            max_steps = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--out") && i + 1 < argc)
+            out_dir = argv[++i];
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+            cache_size = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && !path)
+            path = argv[i];
+        else if (argv[i][0] != '-' && diff && !diff_path)
+            diff_path = argv[i];
+        else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+        {
+            printUsage(stdout);
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            printUsage(stderr);
+            return 1;
+        }
+    }
+
+    if (stats || stats_out)
+        statsEnable(stats, stats_out);
+
+    if (bench_base)
+        return compareBench(bench_base, bench_out, threshold) ? 1 : 0;
+
+    if (bench)
+        return runBench(bench_out, word_bits, saturate) ? 1 : 0;
+
+    if (socket_path)
+        return runServer(socket_path, threads, cache_size) ? 1 : 0;
+
+    setvbuf(stdin, NULL, _IONBF, 0);
+
+    struct SessionHeader session;
+    int resume = 0;
+    if (session_arg)
+    {
+        snprintf(session_path, sizeof(session_path), "%s", session_arg);
+        if (!access(session_arg, F_OK))
+        {
+            if (sessionHeader(session_arg, &session))
+                return 1;
+            resume    = 1;
+            flags     = session.flags;
+            word_bits = session.word_bits;
+            saturate  = session.saturate;
+            if (!path)
+                path = session.program;
+        }
+    }
+
+    struct Code* loaded_code = path ? loadFromFile(path, flags) : runLoad(flags);
 
     if (!loaded_code)
         return 0;
 
-    printf("Successfully loaded\n\n");
+    load_flags = flags;
+    if (path && !realpath(path, program_path))
+        snprintf(program_path, sizeof(program_path), "%s", path);
+
+    if (setWordWidth(loaded_code, word_bits, saturate))
+    {
+        codeDtor(loaded_code);
+        return 1;
+    }
+
+    if (fuzz)
+    {
+        int status = runFuzz(loaded_code, out_dir, threads, seconds, max_steps < 0 ? 100000 : max_steps);
+        codeDtor(loaded_code);
+        return status < 0 ? 1 : 0;
+    }
+
+    if (diff)
+    {
+        int status = runDiffMode(loaded_code, diff_path, flags, word_bits, saturate, max_steps < 0 ? MAX_STATE_LENGTH : max_steps);
+        codeDtor(loaded_code);
+        return status ? 1 : 0;
+    }
+
+    if (query_text)
+    {
+        struct Query query;
+        char err_str[128] = "";
+        if (queryParse(&query, loaded_code, query_text, err_str))
+        {
+            fprintf(stderr, "Invalid query: %s\n", err_str);
+            codeDtor(loaded_code);
+            return 1;
+        }
+
+        readInputs(loaded_code);
+        int status = runQuery(loaded_code, &query, max_steps < 0 ? QUERY_MAX_STEPS : max_steps);
+        codeDtor(loaded_code);
+        return status ? 1 : 0;
+    }
+
+    if (headless)
+    {
+        int status = runHeadless(loaded_code, use_aot, max_steps < 0 ? MAX_STATE_LENGTH : max_steps);
+        codeDtor(loaded_code);
+        return status ? 1 : 0;
+    }
 
     struct Code active_code;
 
     if (codeCpy(loaded_code, &active_code))
         return 0;
 
-    while (runCode(&active_code))
+    struct State resumed;
+    struct SessionView view;
+    if (resume && sessionRestore(session_path, program_path, &active_code, &resumed, &view))
+    {
+        codeFree(&active_code);
+        codeDtor(loaded_code);
+        return 1;
+    }
+
+    printf("Successfully loaded\n\n");
+    termInit();
+
+    int again = resume ? runCode(&active_code, &resumed, &view) : runCode(&active_code, NULL, NULL);
+
+    while (again)
     {
+        codeFree(&active_code);
         if (codeCpy(loaded_code, &active_code))
         return 0;
+        again = runCode(&active_code, NULL, NULL);
     }
 
+    codeFree(&active_code);
     codeDtor(loaded_code);
     return 0;
 }
\ No newline at end of file
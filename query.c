@@ -0,0 +1,513 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "query.h"
+#include "stats.h"
+
+#define QUERY_VECTOR    16
+#define QUERY_LANES     ((int)(QUERY_VECTOR / sizeof(word_t)))
+#define QUERY_CHUNK     512
+#define QUERY_PRINT     20
+
+typedef word_t lanes_t __attribute__((vector_size(QUERY_VECTOR)));
+
+static const char * skipSpaces(const char * s)
+{
+    while (*s == ' ' || *s == '\t')
+        s++;
+    return s;
+}
+
+static int parseOperand(struct Code * code, int ip_col, const char ** text, int * col, word_t * val, char * err_str)
+{
+    const char * s = skipSpaces(*text);
+    char * end;
+
+    if (*s == '[')
+    {
+        unsigned long ptr = strtoul(s + 1, &end, 16);
+        if (end == s + 1 || *end != ']')
+        {
+            sprintf(err_str, "expected [XXXX] at '%.20s'", s);
+            return -1;
+        }
+        if (ptr >= MEM_SIZE || code->cell_slots[ptr] < 0)
+        {
+            sprintf(err_str, "no cell at 0x%04lX", ptr);
+            return -1;
+        }
+        *col  = code->cell_slots[ptr];
+        *text = end + 1;
+        return 0;
+    }
+
+    if ((s[0] == 'i' || s[0] == 'I') && (s[1] == 'p' || s[1] == 'P') && !isalnum((unsigned char)s[2]))
+    {
+        *col  = ip_col;
+        *text = s + 2;
+        return 0;
+    }
+
+    const char * digits = s + (*s == '-' || *s == '+');
+    int base = digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X') ? 16 : 10;
+    long long value = strtoll(s, &end, base);
+    if (end == s)
+    {
+        sprintf(err_str, "expected cell, ip or number at '%.20s'", s);
+        return -1;
+    }
+    *col  = QUERY_CONST;
+    *val  = value;
+    *text = end;
+    return 0;
+}
+
+static int parseOp(const char ** text, int * op)
+{
+    static const char * names[] = { "==", "!=", "<=", ">=", "<", ">", "=" };
+    static const int ops[] = { QUERY_EQ, QUERY_NE, QUERY_LE, QUERY_GE, QUERY_LT, QUERY_GT, QUERY_EQ };
+
+    const char * s = skipSpaces(*text);
+    int i;
+    for (i = 0; i < 7; ++i)
+    {
+        int len = strlen(names[i]);
+        if (!strncmp(s, names[i], len))
+        {
+            *op   = ops[i];
+            *text = s + len;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int queryParse(struct Query * q, struct Code * code, const char * text, char * err_str)
+{
+    q->clause_cnt = 0;
+    q->ip_col     = code->slot_cnt;
+
+    int starts_group = 1;
+    while (1)
+    {
+        if (q->clause_cnt == QUERY_MAX_CLAUSES)
+        {
+            sprintf(err_str, "too many conditions (at most %d)", QUERY_MAX_CLAUSES);
+            return -1;
+        }
+
+        struct Clause * c = q->clauses + q->clause_cnt;
+        c->starts_group = starts_group;
+
+        if (parseOperand(code, q->ip_col, &text, &c->lhs, &c->lhs_val, err_str))
+            return -1;
+        if (parseOp(&text, &c->op))
+        {
+            sprintf(err_str, "expected comparison at '%.20s'", skipSpaces(text));
+            return -1;
+        }
+        if (parseOperand(code, q->ip_col, &text, &c->rhs, &c->rhs_val, err_str))
+            return -1;
+
+        if (c->lhs == QUERY_CONST && c->rhs != QUERY_CONST)
+        {
+            static const int mirrored[] = { QUERY_EQ, QUERY_NE, QUERY_GT, QUERY_GE, QUERY_LT, QUERY_LE };
+            c->lhs     = c->rhs;
+            c->rhs     = QUERY_CONST;
+            c->rhs_val = c->lhs_val;
+            c->op      = mirrored[c->op];
+        }
+        q->clause_cnt++;
+
+        text = skipSpaces(text);
+        if (!*text)
+            return 0;
+
+        if (!strncmp(text, "&&", 2))
+            starts_group = 0;
+        else if (!strncmp(text, "||", 2))
+            starts_group = 1;
+        else
+        {
+            sprintf(err_str, "expected && or || at '%.20s'", text);
+            return -1;
+        }
+        text += 2;
+    }
+}
+
+static int queryColumns(struct Query * q, int * cols)
+{
+    int i, j, cnt = 0;
+    for (i = 0; i < q->clause_cnt; ++i)
+    {
+        int used[2] = { q->clauses[i].lhs, q->clauses[i].rhs };
+        for (j = 0; j < 2; ++j)
+        {
+            int k = 0;
+            while (k < cnt && cols[k] != used[j])
+                k++;
+            if (used[j] != QUERY_CONST && k == cnt)
+                cols[cnt++] = used[j];
+        }
+    }
+    return cnt;
+}
+
+void traceInit(struct Trace * tr, struct Code * code)
+{
+    tr->length   = 0;
+    tr->capacity = 0;
+    tr->col_cnt  = code->slot_cnt + 1;
+    tr->cols     = (word_t **) calloc(tr->col_cnt, sizeof(word_t *));
+    tr->col_len  = (long long *) calloc(tr->col_cnt, sizeof(long long));
+}
+
+void traceFree(struct Trace * tr)
+{
+    int i;
+    for (i = 0; i < tr->col_cnt; ++i)
+        free(tr->cols[i]);
+    free(tr->cols);
+    free(tr->col_len);
+}
+
+void traceTruncate(struct Trace * tr, long long row)
+{
+    int i;
+    for (i = 0; i < tr->col_cnt; ++i)
+        if (tr->col_len[i] > row)
+            tr->col_len[i] = row;
+    if (tr->length > row)
+        tr->length = row;
+}
+
+static int traceReserve(struct Trace * tr, long long rows, int * cols, int cnt)
+{
+    if (!tr->cols || !tr->col_len)
+        return -1;
+
+    int i;
+    if (rows > tr->capacity)
+    {
+        long long capacity = tr->capacity ? tr->capacity * 2 : 1024;
+        if (capacity < rows)
+            capacity = rows;
+
+        for (i = 0; i < tr->col_cnt; ++i)
+        {
+            if (!tr->cols[i])
+                continue;
+            word_t * col = (word_t *) realloc(tr->cols[i], sizeof(word_t) * capacity);
+            if (!col)
+                return -1;
+            tr->cols[i] = col;
+        }
+        tr->capacity = capacity;
+    }
+
+    for (i = 0; i < cnt; ++i)
+    {
+        if (!tr->cols[cols[i]])
+        {
+            tr->cols[cols[i]]    = (word_t *) malloc(sizeof(word_t) * tr->capacity);
+            tr->col_len[cols[i]] = 0;
+            if (!tr->cols[cols[i]])
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int traceSync(struct Trace * tr, struct Query * q, struct State * st)
+{
+    int cols[QUERY_MAX_CLAUSES * 2];
+    int cnt = queryColumns(q, cols);
+
+    if (traceReserve(tr, st->length, cols, cnt))
+        return -1;
+
+    int i;
+    long long row;
+    for (i = 0; i < cnt; ++i)
+    {
+        word_t * col = tr->cols[cols[i]];
+        if (cols[i] == q->ip_col)
+        {
+            for (row = tr->col_len[cols[i]]; row < st->length; ++row)
+                col[row] = st->rows[row].cmd_ptr;
+        }
+        else
+        {
+            for (row = tr->col_len[cols[i]]; row < st->length; ++row)
+                col[row] = st->rows[row].values[cols[i]];
+        }
+        tr->col_len[cols[i]] = st->length;
+    }
+    tr->length = st->length;
+    return 0;
+}
+
+static int traceAppend(struct Trace * tr, struct Code * code, int cmd_ptr, int * cols, int cnt)
+{
+    if (tr->length == tr->capacity && traceReserve(tr, tr->length + 1, cols, cnt))
+        return -1;
+
+    int i;
+    for (i = 0; i < cnt; ++i)
+        tr->cols[cols[i]][tr->length] = cols[i] == tr->col_cnt - 1 ? cmd_ptr : code->mem_vals[cols[i]];
+    tr->length++;
+    return 0;
+}
+
+static inline int compareWords(int op, word_t a, word_t b)
+{
+    switch (op)
+    {
+        case QUERY_EQ: return a == b;
+        case QUERY_NE: return a != b;
+        case QUERY_LT: return a <  b;
+        case QUERY_LE: return a <= b;
+        case QUERY_GT: return a >  b;
+    }
+    return a >= b;
+}
+
+#define COMPARE_LOOP(OP, SET) \
+    if (c->rhs == QUERY_CONST) \
+    { \
+        lanes_t b; \
+        for (k = 0; k < QUERY_LANES; ++k) \
+            b[k] = c->rhs_val; \
+        for (k = 0; k < vecs; ++k) \
+        { \
+            memcpy(&a, lhs + k * QUERY_LANES, sizeof(a)); \
+            dst[k] SET a OP b; \
+        } \
+    } \
+    else for (k = 0; k < vecs; ++k) \
+    { \
+        lanes_t b; \
+        memcpy(&a, lhs + k * QUERY_LANES, sizeof(a)); \
+        memcpy(&b, rhs + k * QUERY_LANES, sizeof(b)); \
+        dst[k] SET a OP b; \
+    }
+
+#define COMPARE_CHUNK(OP) \
+    if (first) { COMPARE_LOOP(OP, =) } \
+    else { COMPARE_LOOP(OP, &=) }
+
+__attribute__((target_clones("avx2", "default")))
+static void compareChunk(struct Clause * c, struct Trace * tr, long long row, int vecs, lanes_t * dst, int first)
+{
+    int k;
+    if (c->lhs == QUERY_CONST && c->rhs == QUERY_CONST)
+    {
+        if (!compareWords(c->op, c->lhs_val, c->rhs_val))
+            memset(dst, 0, sizeof(lanes_t) * vecs);
+        else if (first)
+            memset(dst, 0xFF, sizeof(lanes_t) * vecs);
+        return;
+    }
+
+    const word_t * lhs = tr->cols[c->lhs] + row;
+    const word_t * rhs = c->rhs == QUERY_CONST ? NULL : tr->cols[c->rhs] + row;
+    lanes_t a;
+
+    switch (c->op)
+    {
+        case QUERY_EQ: COMPARE_CHUNK(==) break;
+        case QUERY_NE: COMPARE_CHUNK(!=) break;
+        case QUERY_LT: COMPARE_CHUNK(<)  break;
+        case QUERY_LE: COMPARE_CHUNK(<=) break;
+        case QUERY_GT: COMPARE_CHUNK(>)  break;
+        default:       COMPARE_CHUNK(>=) break;
+    }
+}
+
+static void evalChunk(struct Query * q, struct Trace * tr, long long row, int vecs, lanes_t * res)
+{
+    lanes_t all[QUERY_CHUNK / QUERY_LANES];
+    lanes_t * dst = res;
+    int i, k;
+
+    for (i = 0; i < q->clause_cnt; ++i)
+    {
+        if (i > 0 && q->clauses[i].starts_group)
+            dst = all;
+        compareChunk(q->clauses + i, tr, row, vecs, dst, q->clauses[i].starts_group);
+
+        if (dst == all && (i + 1 == q->clause_cnt || q->clauses[i + 1].starts_group))
+            for (k = 0; k < vecs; ++k)
+                res[k] |= all[k];
+    }
+}
+
+static int evalRow(struct Query * q, struct Trace * tr, long long row)
+{
+    int any = 0, all = 0, i;
+    for (i = 0; i < q->clause_cnt; ++i)
+    {
+        struct Clause * c = q->clauses + i;
+        if (c->starts_group)
+        {
+            any |= all;
+            all  = 1;
+        }
+        word_t a = c->lhs == QUERY_CONST ? c->lhs_val : tr->cols[c->lhs][row];
+        word_t b = c->rhs == QUERY_CONST ? c->rhs_val : tr->cols[c->rhs][row];
+        all &= compareWords(c->op, a, b);
+    }
+    return any | all;
+}
+
+long long queryFind(struct Query * q, struct Trace * tr, long long from, long long to)
+{
+    STATS_BEGIN(start);
+
+    if (to > tr->length)
+        to = tr->length;
+
+    lanes_t res[QUERY_CHUNK / QUERY_LANES];
+    long long row = from < 0 ? 0 : from, found = -1;
+
+    while (found < 0 && to - row >= QUERY_LANES)
+    {
+        int vecs = (to - row < QUERY_CHUNK ? to - row : QUERY_CHUNK) / QUERY_LANES;
+        evalChunk(q, tr, row, vecs, res);
+
+        int k, j;
+        for (k = 0; k < vecs && found < 0; ++k)
+        {
+            word_t hit = 0;
+            for (j = 0; j < QUERY_LANES; ++j)
+                hit |= res[k][j];
+            if (!hit)
+                continue;
+
+            for (j = 0; !res[k][j]; ++j);
+            found = row + k * QUERY_LANES + j;
+        }
+        row += vecs * QUERY_LANES;
+    }
+
+    for (; row < to && found < 0; ++row)
+        if (evalRow(q, tr, row))
+            found = row;
+
+    STATS_END(STAT_QUERY, start);
+    return found;
+}
+
+long long queryCount(struct Query * q, struct Trace * tr)
+{
+    STATS_BEGIN(start);
+
+    lanes_t res[QUERY_CHUNK / QUERY_LANES], acc = { 0 };
+    long long row = 0, cnt = 0;
+
+    while (tr->length - row >= QUERY_LANES)
+    {
+        int vecs = (tr->length - row < QUERY_CHUNK ? tr->length - row : QUERY_CHUNK) / QUERY_LANES;
+        evalChunk(q, tr, row, vecs, res);
+
+        int k;
+        for (k = 0; k < vecs; ++k)
+            acc -= res[k];
+        row += vecs * QUERY_LANES;
+    }
+
+    int j;
+    for (j = 0; j < QUERY_LANES; ++j)
+        cnt += acc[j];
+    for (; row < tr->length; ++row)
+        cnt += evalRow(q, tr, row);
+
+    STATS_END(STAT_QUERY, start);
+    return cnt;
+}
+
+static void printOperand(struct Code * code, struct Query * q, struct Trace * tr, int col, long long row)
+{
+    char value[48];
+    formatWord(value, tr->cols[col][row]);
+    if (col == q->ip_col)
+         printf("   ip = 0x%04X", (int)tr->cols[col][row]);
+    else printf("   [%04X] = %s", code->mem_ptrs[col], value);
+}
+
+int runQuery(struct Code * code, struct Query * q, long long max_steps)
+{
+    char err_str[128] = "";
+
+    int cols[QUERY_MAX_CLAUSES * 2 + 1];
+    int cnt = queryColumns(q, cols);
+    int i;
+    for (i = 0; i < cnt && cols[i] != q->ip_col; ++i);
+    if (i == cnt)
+        cols[cnt++] = q->ip_col;
+
+    struct Trace tr;
+    traceInit(&tr, code);
+
+    StepFunc step = selectStep(code);
+    int cmd_i = 0, cmd_ptr = code->mem_start, status = 0;
+    long long steps = 0;
+
+    STATS_BEGIN(run_start);
+    PROBE_RUN_START(code->length);
+
+    while (1)
+    {
+        if (traceAppend(&tr, code, cmd_ptr, cols, cnt))
+        {
+            fprintf(stderr, "Couldn't allocate memory for trace of %lld rows\n", tr.length);
+            traceFree(&tr);
+            return -1;
+        }
+        if (steps == max_steps)
+            break;
+
+        steps++;
+        if ((status = step(code, err_str, &cmd_i, &cmd_ptr)))
+            break;
+    }
+
+    if (!status)
+    {
+        PROBE_STEP_LIMIT(steps);
+        STATS_COUNT(STAT_LIMITS, 1);
+        sprintf(err_str, "stopped after %lld steps", steps);
+    }
+    PROBE_RUN_FINISH(steps, status);
+
+    STATS_END(STAT_RUN, run_start);
+    STATS_COUNT(STAT_STEPS, steps);
+    STATS_COUNT(STAT_RUNS, 1);
+
+    printf("%s\nsteps: %lld\n", err_str, steps);
+
+    long long start = statsNow();
+    long long matches = queryCount(q, &tr);
+    printf("matches: %lld of %lld rows (%.3f ms)\n", matches, tr.length, (statsNow() - start) / 1e6);
+
+    long long row = -1;
+    int shown;
+    for (shown = 0; shown < QUERY_PRINT; ++shown)
+    {
+        if ((row = queryFind(q, &tr, row + 1, tr.length)) < 0)
+            break;
+
+        printf("row %lld:", row);
+        printOperand(code, q, &tr, q->ip_col, row);
+        for (i = 0; i < cnt; ++i)
+            if (cols[i] != q->ip_col)
+                printOperand(code, q, &tr, cols[i], row);
+        printf("\n");
+    }
+    if (matches > shown)
+        printf("... %lld more\n", matches - shown);
+
+    traceFree(&tr);
+    return 0;
+}
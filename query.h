@@ -0,0 +1,55 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "engine.h"
+
+ #define QUERY_MAX_CLAUSES 8
+ #define QUERY_MAX_STEPS   (1LL << 25)
+
+ #define QUERY_EQ 0
+ #define QUERY_NE 1
+ #define QUERY_LT 2
+ #define QUERY_LE 3
+ #define QUERY_GT 4
+ #define QUERY_GE 5
+
+ #define QUERY_CONST -1
+
+ struct Clause {
+     int op;
+     int lhs, rhs;
+     word_t lhs_val, rhs_val;
+     int starts_group;
+ };
+
+ struct Query {
+     struct Clause clauses[QUERY_MAX_CLAUSES];
+     int clause_cnt;
+     int ip_col;
+ };
+
+ struct Trace {
+     long long length;
+     long long capacity;
+     int col_cnt;
+     word_t ** cols;
+     long long * col_len;
+ };
+
+ int queryParse(struct Query * q, struct Code * code, const char * text, char * err_str);
+
+ void traceInit(struct Trace * tr, struct Code * code);
+
+ void traceFree(struct Trace * tr);
+
+ void traceTruncate(struct Trace * tr, long long row);
+
+ int traceSync(struct Trace * tr, struct Query * q, struct State * st);
+
+ long long queryFind(struct Query * q, struct Trace * tr, long long from, long long to);
+
+ long long queryCount(struct Query * q, struct Trace * tr);
+
+ int runQuery(struct Code * code, struct Query * q, long long max_steps);
+
+#endif
@@ -0,0 +1,742 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "engine.h"
+#include "stats.h"
+#include "server.h"
+
+/*
+ * Line protocol, one request at a time per connection:
+ *
+ *   LOAD <bytes> [flags] [word_bits] [saturate]\n<program text>
+ *       -> OK <handle>
+ *   RUN <handle> <max_steps> <trace 0|1> [input values of '<' cells]
+ *       -> RESULT <status> <steps> <message>
+ *          CELLS <values>
+ *          ROW <cmd_ptr> <values>      (trace only, one per row)
+ *          END
+ *   STATS
+ *       -> OK <cached> <hits> <misses> <runs>
+ *
+ * Failed requests are answered with ERR <message>.
+ *
+ * Idle connections wait in the accept loop's poll set; a worker takes a
+ * connection only while it has a request to answer and hands it back after.
+ * Every run, traced or not, is capped at MAX_RUN_STEPS and RUN_TIME_LIMIT.
+ * The trace flag never changes RESULT or CELLS: a traced run stops recording
+ * rows once the trace finds a loop or holds MAX_STATE_LENGTH rows, and keeps
+ * running to the same limits as an untraced one.
+ */
+
+#define MAX_PROGRAM_SIZE (4 << 20)
+#define MAX_LINE_SIZE    (1 << 16)
+#define QUEUE_SIZE       256
+#define MAX_RUN_STEPS    (1LL << 34)
+#define RUN_TIME_LIMIT   (10 * 1000000000LL)
+#define RUN_SLICE        (1 << 16)
+
+struct CacheEntry {
+    unsigned long long hash;
+    struct Code * code;
+    int refs;
+    int evicted;
+    struct CacheEntry * prev, * next;
+};
+
+struct Conn {
+    int fd;
+    FILE * out;
+    char * buf;
+    size_t start, len, cap;
+};
+
+struct PollSet {
+    struct pollfd * fds;
+    struct Conn ** conns;
+    int cnt, cap;
+};
+
+struct Scratch {
+    struct Code code;
+    word_t * vals;
+    struct Command * rows;
+    signed char * row_state;
+    int * inputs;
+    int slot_cap, row_cap, input_cap;
+};
+
+struct Server {
+    pthread_mutex_t cache_lock;
+    struct CacheEntry * head, * tail;
+    int cached, capacity;
+    long long hits, misses, runs;
+
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    struct Conn * queue[QUEUE_SIZE];
+    int q_head, q_cnt;
+    int wake_fd[2];
+};
+
+static volatile sig_atomic_t server_stop = 0;
+
+static void onSignal(int sig)
+{
+    (void) sig;
+    server_stop = 1;
+}
+
+static unsigned long long hashProgram(const char * text, size_t size, int flags, int word_bits, int saturate)
+{
+    unsigned long long hash = 1469598103934665603ULL;
+
+    size_t i;
+    for (i = 0; i < size; ++i)
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+
+    hash = (hash ^ (unsigned int)flags)     * 1099511628211ULL;
+    hash = (hash ^ (unsigned int)word_bits) * 1099511628211ULL;
+    hash = (hash ^ (unsigned int)saturate)  * 1099511628211ULL;
+    return hash;
+}
+
+static void cacheUnlink(struct Server * srv, struct CacheEntry * e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else srv->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else srv->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cachePushFront(struct Server * srv, struct CacheEntry * e)
+{
+    e->prev = NULL;
+    e->next = srv->head;
+    if (srv->head)
+        srv->head->prev = e;
+    srv->head = e;
+    if (!srv->tail)
+        srv->tail = e;
+}
+
+static struct CacheEntry * cacheAcquire(struct Server * srv, unsigned long long hash)
+{
+    pthread_mutex_lock(&srv->cache_lock);
+
+    struct CacheEntry * e;
+    for (e = srv->head; e; e = e->next)
+    {
+        if (e->hash == hash)
+            break;
+    }
+
+    if (e)
+    {
+        cacheUnlink(srv, e);
+        cachePushFront(srv, e);
+        e->refs++;
+        srv->hits++;
+    }
+    else srv->misses++;
+
+    pthread_mutex_unlock(&srv->cache_lock);
+    return e;
+}
+
+static void cacheRelease(struct Server * srv, struct CacheEntry * e)
+{
+    pthread_mutex_lock(&srv->cache_lock);
+    int drop = --e->refs == 0 && e->evicted;
+    pthread_mutex_unlock(&srv->cache_lock);
+
+    if (drop)
+    {
+        codeDtor(e->code);
+        free(e);
+    }
+}
+
+static void cacheInsert(struct Server * srv, unsigned long long hash, struct Code * code)
+{
+    struct CacheEntry * e = (struct CacheEntry*) calloc(1, sizeof(struct CacheEntry));
+    if (!e)
+    {
+        codeDtor(code);
+        return;
+    }
+    e->hash = hash;
+    e->code = code;
+
+    pthread_mutex_lock(&srv->cache_lock);
+
+    struct CacheEntry * it;
+    for (it = srv->head; it; it = it->next)
+    {
+        if (it->hash == hash)
+            break;
+    }
+
+    struct CacheEntry * victim = NULL;
+    if (it)
+    {
+        victim = e;
+    }
+    else
+    {
+        cachePushFront(srv, e);
+        if (++srv->cached > srv->capacity)
+        {
+            victim = srv->tail;
+            cacheUnlink(srv, victim);
+            srv->cached--;
+            victim->evicted = 1;
+            if (victim->refs)
+                victim = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&srv->cache_lock);
+
+    if (victim)
+    {
+        codeDtor(victim->code);
+        free(victim);
+    }
+}
+
+static int scratchPrepare(struct Scratch * s, struct Code * image)
+{
+    if (s->slot_cap < image->slot_cnt)
+    {
+        s->slot_cap = image->slot_cnt;
+        s->vals = (word_t*) realloc(s->vals, sizeof(word_t) * s->slot_cap);
+    }
+    if (s->input_cap < image->mem_cnt)
+    {
+        s->input_cap = image->mem_cnt;
+        s->inputs = (int*) realloc(s->inputs, sizeof(int) * s->input_cap);
+    }
+    if (image->unified && s->row_cap < image->length)
+    {
+        s->row_cap   = image->length;
+        s->rows      = (struct Command*) realloc(s->rows, sizeof(struct Command) * s->row_cap);
+        s->row_state = (signed char*) realloc(s->row_state, s->row_cap);
+    }
+
+    if ((image->slot_cnt && !s->vals) || (image->mem_cnt && !s->inputs) ||
+        (image->unified && (!s->rows || !s->row_state)))
+        return -1;
+
+    s->code = *image;
+    s->code.mem_vals = s->vals;
+    if (image->unified)
+    {
+        s->code.rows      = s->rows;
+        s->code.row_state = s->row_state;
+    }
+
+    codeReset(&s->code, image);
+    return 0;
+}
+
+static void printValues(FILE * out, const char * tag, word_t * values, int cnt)
+{
+    char value[48];
+
+    fputs(tag, out);
+    int i;
+    for (i = 0; i < cnt; ++i)
+    {
+        formatWord(value, values[i]);
+        fputc(' ', out);
+        fputs(value, out);
+    }
+    fputc('\n', out);
+}
+
+static void connClose(struct Conn * c)
+{
+    fclose(c->out);
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static int connFill(struct Conn * c)
+{
+    if (c->start)
+    {
+        memmove(c->buf, c->buf + c->start, c->len - c->start);
+        c->len  -= c->start;
+        c->start = 0;
+    }
+    if (c->len == c->cap)
+    {
+        if (c->cap >= MAX_LINE_SIZE)
+            return -1;
+
+        size_t cap = c->cap ? c->cap * 2 : 4096;
+        char * buf = (char*) realloc(c->buf, cap);
+        if (!buf)
+            return -1;
+        c->buf = buf;
+        c->cap = cap;
+    }
+
+    ssize_t got;
+    do got = read(c->fd, c->buf + c->len, c->cap - c->len);
+    while (got < 0 && errno == EINTR);
+
+    if (got <= 0)
+        return -1;
+    c->len += got;
+    return 0;
+}
+
+static char * connLine(struct Conn * c)
+{
+    char * end = (char*) memchr(c->buf + c->start, '\n', c->len - c->start);
+    if (!end)
+        return NULL;
+
+    char * line = c->buf + c->start;
+    *end = '\0';
+    c->start = end + 1 - c->buf;
+    line[strcspn(line, "\r")] = '\0';
+    return line;
+}
+
+static int connRead(struct Conn * c, char * dst, size_t size)
+{
+    size_t have = c->len - c->start;
+    if (have > size)
+        have = size;
+    memcpy(dst, c->buf + c->start, have);
+    c->start += have;
+
+    while (have < size)
+    {
+        ssize_t got = read(c->fd, dst + have, size - have);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        have += got;
+    }
+    return 0;
+}
+
+static void handleLoad(struct Server * srv, struct Conn * c, const char * args)
+{
+    long size = 0;
+    int flags = 0, word_bits = 64, saturate = 0;
+
+    if (sscanf(args, "%ld %d %d %d", &size, &flags, &word_bits, &saturate) < 1 ||
+        size <= 0 || size > MAX_PROGRAM_SIZE)
+    {
+        fprintf(c->out, "ERR invalid LOAD request\n");
+        return;
+    }
+
+    char * text = (char*) malloc(size);
+    if (!text || connRead(c, text, size))
+    {
+        free(text);
+        fprintf(c->out, "ERR couldn't read program text\n");
+        return;
+    }
+
+    unsigned long long hash = hashProgram(text, size, flags, word_bits, saturate);
+
+    struct CacheEntry * e = cacheAcquire(srv, hash);
+    if (e)
+    {
+        cacheRelease(srv, e);
+        free(text);
+        fprintf(c->out, "OK %016llx\n", hash);
+        return;
+    }
+
+    FILE * stream = fmemopen(text, size, "r");
+    struct Code * code = stream ? loadFromStream(stream, flags) : NULL;
+    if (stream)
+        fclose(stream);
+    free(text);
+
+    if (!code || setWordWidth(code, word_bits, saturate))
+    {
+        if (code)
+            codeDtor(code);
+        fprintf(c->out, "ERR couldn't load program\n");
+        return;
+    }
+
+    cacheInsert(srv, hash, code);
+    fprintf(c->out, "OK %016llx\n", hash);
+}
+
+static long long runLimited(struct Code * code, struct State * st, long long max_steps, int * status, char * err_str, int * timed_out)
+{
+    StepFunc step = selectStep(code);
+    int cmd_i = 0, cmd_ptr = code->mem_start;
+    long long steps = 0, deadline = statsNow() + RUN_TIME_LIMIT;
+
+    STATS_BEGIN(start);
+    PROBE_RUN_START(code->length);
+
+    *status = 0;
+    if (st && stateAddRow(st, code, cmd_i, cmd_ptr))
+        st = NULL;
+
+    while (!*status && steps < max_steps)
+    {
+        long long slice = steps + RUN_SLICE < max_steps ? steps + RUN_SLICE : max_steps;
+        while (steps < slice)
+        {
+            steps++;
+            if ((*status = step(code, err_str, &cmd_i, &cmd_ptr)))
+                break;
+            if (st && stateAddRow(st, code, cmd_i, cmd_ptr))
+                st = NULL;
+        }
+        if (!*status && steps < max_steps && statsNow() > deadline)
+        {
+            *timed_out = 1;
+            break;
+        }
+    }
+
+    if (!*status)
+    {
+        PROBE_STEP_LIMIT(steps);
+        STATS_COUNT(STAT_LIMITS, 1);
+    }
+    PROBE_RUN_FINISH(steps, *status);
+
+    STATS_END(STAT_RUN, start);
+    STATS_COUNT(STAT_STEPS, steps);
+    STATS_COUNT(STAT_RUNS, 1);
+    return steps;
+}
+
+static void handleRun(struct Server * srv, struct Scratch * s, FILE * out, char * args)
+{
+    unsigned long long hash;
+    long long max_steps;
+    int trace, used;
+
+    if (sscanf(args, "%llx %lld %d%n", &hash, &max_steps, &trace, &used) != 3 || max_steps <= 0)
+    {
+        fprintf(out, "ERR invalid RUN request\n");
+        return;
+    }
+
+    struct CacheEntry * e = cacheAcquire(srv, hash);
+    if (!e)
+    {
+        fprintf(out, "ERR unknown handle %016llx\n", hash);
+        return;
+    }
+
+    if (scratchPrepare(s, e->code))
+    {
+        cacheRelease(srv, e);
+        fprintf(out, "ERR out of memory\n");
+        return;
+    }
+
+    struct Code * code = &s->code;
+
+    int i, input_cnt = 0;
+    for (i = 0; i < code->mem_cnt; ++i)
+    {
+        if (code->mem_vals[i] == INPUT_FLAG)
+            s->inputs[input_cnt++] = i;
+    }
+
+    FILE * values = fmemopen(args + used, strlen(args + used), "r");
+    for (i = 0; values && i < input_cnt; ++i)
+    {
+        if (scanWord(values, code->mem_vals + s->inputs[i]))
+            break;
+        code->mem_vals[s->inputs[i]] = fitWord(code, code->mem_vals[s->inputs[i]]);
+    }
+    if (values)
+        fclose(values);
+
+    if (i != input_cnt)
+    {
+        cacheRelease(srv, e);
+        fprintf(out, "ERR expected %d input values\n", input_cnt);
+        return;
+    }
+
+    char err_str[128] = "", message[128];
+    int status = 0, timed_out = 0;
+
+    struct State st;
+    stateInit(&st);
+
+    if (max_steps > MAX_RUN_STEPS)
+        max_steps = MAX_RUN_STEPS;
+    long long steps = runLimited(code, trace ? &st : NULL, max_steps, &status, err_str, &timed_out);
+
+    stripColors(message, err_str, sizeof(message));
+    fprintf(out, "RESULT %d %lld %s\n", status, steps,
+            status ? message : timed_out ? "time limit reached" : "step limit reached");
+    printValues(out, "CELLS", code->mem_vals, code->mem_cnt);
+
+    for (i = 0; i < st.length; ++i)
+    {
+        char tag[16];
+        sprintf(tag, "ROW %04X", st.rows[i].cmd_ptr);
+        printValues(out, tag, st.rows[i].values, code->mem_cnt);
+    }
+    fprintf(out, "END\n");
+
+    stateFree(&st);
+    cacheRelease(srv, e);
+
+    pthread_mutex_lock(&srv->cache_lock);
+    srv->runs++;
+    pthread_mutex_unlock(&srv->cache_lock);
+}
+
+static int serveRequests(struct Server * srv, struct Scratch * s, struct Conn * c)
+{
+    if (connFill(c))
+        return -1;
+
+    char * line;
+    while ((line = connLine(c)))
+    {
+        if (!strncmp(line, "LOAD ", 5))
+            handleLoad(srv, c, line + 5);
+        else if (!strncmp(line, "RUN ", 4))
+            handleRun(srv, s, c->out, line + 4);
+        else if (!strcmp(line, "STATS"))
+        {
+            pthread_mutex_lock(&srv->cache_lock);
+            fprintf(c->out, "OK %d %lld %lld %lld\n", srv->cached, srv->hits, srv->misses, srv->runs);
+            pthread_mutex_unlock(&srv->cache_lock);
+        }
+        else if (line[0])
+            fprintf(c->out, "ERR unknown request\n");
+
+        if (fflush(c->out))
+            return -1;
+    }
+    return 0;
+}
+
+static void * serverWorker(void * arg)
+{
+    struct Server * srv = (struct Server*) arg;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct Scratch s;
+    memset(&s, 0, sizeof(s));
+
+    while (1)
+    {
+        pthread_mutex_lock(&srv->queue_lock);
+        while (!srv->q_cnt)
+            pthread_cond_wait(&srv->queue_cond, &srv->queue_lock);
+
+        struct Conn * c = srv->queue[srv->q_head];
+        srv->q_head = (srv->q_head + 1) % QUEUE_SIZE;
+        srv->q_cnt--;
+        pthread_cond_broadcast(&srv->queue_cond);
+        pthread_mutex_unlock(&srv->queue_lock);
+
+        if (serveRequests(srv, &s, c) || write(srv->wake_fd[1], &c, sizeof(c)) != sizeof(c))
+            connClose(c);
+    }
+    return NULL;
+}
+
+static int pollAdd(struct PollSet * ps, int fd, struct Conn * c)
+{
+    if (ps->cnt == ps->cap)
+    {
+        int cap = ps->cap ? ps->cap * 2 : 64;
+        struct pollfd * fds = (struct pollfd*) realloc(ps->fds, sizeof(struct pollfd) * cap);
+        if (fds)
+            ps->fds = fds;
+        struct Conn ** conns = (struct Conn**) realloc(ps->conns, sizeof(struct Conn*) * cap);
+        if (conns)
+            ps->conns = conns;
+        if (!fds || !conns)
+            return -1;
+        ps->cap = cap;
+    }
+
+    ps->fds[ps->cnt].fd      = fd;
+    ps->fds[ps->cnt].events  = POLLIN;
+    ps->fds[ps->cnt].revents = 0;
+    ps->conns[ps->cnt++]     = c;
+    return 0;
+}
+
+static void queuePush(struct Server * srv, struct Conn * c)
+{
+    pthread_mutex_lock(&srv->queue_lock);
+    while (srv->q_cnt == QUEUE_SIZE)
+        pthread_cond_wait(&srv->queue_cond, &srv->queue_lock);
+    srv->queue[(srv->q_head + srv->q_cnt) % QUEUE_SIZE] = c;
+    srv->q_cnt++;
+    pthread_cond_broadcast(&srv->queue_cond);
+    pthread_mutex_unlock(&srv->queue_lock);
+}
+
+static void acceptConn(struct PollSet * ps, int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN)
+            perror("accept");
+        return;
+    }
+
+    struct Conn * c = (struct Conn*) calloc(1, sizeof(struct Conn));
+    int out_fd = c ? dup(fd) : -1;
+    FILE * out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (!out)
+    {
+        if (out_fd >= 0)
+            close(out_fd);
+        free(c);
+        close(fd);
+        return;
+    }
+
+    c->fd  = fd;
+    c->out = out;
+    if (pollAdd(ps, fd, c))
+        connClose(c);
+}
+
+int runServer(const char * socket_path, int threads, int cache_size)
+{
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(listen_fd, 64))
+    {
+        perror("bind");
+        close(listen_fd);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct Server * srv = (struct Server*) calloc(1, sizeof(struct Server));
+    srv->capacity = cache_size > 0 ? cache_size : 64;
+    pthread_mutex_init(&srv->cache_lock, NULL);
+    pthread_mutex_init(&srv->queue_lock, NULL);
+    pthread_cond_init(&srv->queue_cond, NULL);
+    if (pipe(srv->wake_fd))
+    {
+        perror("pipe");
+        close(listen_fd);
+        return -1;
+    }
+
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    int i;
+    for (i = 0; i < threads; ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serverWorker, srv))
+            break;
+        pthread_detach(thread);
+    }
+
+    printf("Serving on \"%s\" with %d threads, cache of %d programs\n", socket_path, i, srv->capacity);
+    fflush(stdout);
+
+    struct PollSet ps;
+    memset(&ps, 0, sizeof(ps));
+    if (pollAdd(&ps, listen_fd, NULL) || pollAdd(&ps, srv->wake_fd[0], NULL))
+        server_stop = 1;
+
+    while (!server_stop)
+    {
+        if (poll(ps.fds, ps.cnt, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (ps.fds[1].revents & POLLIN)
+        {
+            struct Conn * done[64];
+            ssize_t got = read(srv->wake_fd[0], done, sizeof(done));
+            int j;
+            for (j = 0; j < (int)(got / (ssize_t)sizeof(struct Conn*)); ++j)
+                if (pollAdd(&ps, done[j]->fd, done[j]))
+                    connClose(done[j]);
+        }
+        if (ps.fds[0].revents & POLLIN)
+            acceptConn(&ps, listen_fd);
+
+        for (i = 2; i < ps.cnt; )
+        {
+            if (!ps.fds[i].revents)
+            {
+                ++i;
+                continue;
+            }
+
+            queuePush(srv, ps.conns[i]);
+            ps.cnt--;
+            ps.fds[i]   = ps.fds[ps.cnt];
+            ps.conns[i] = ps.conns[ps.cnt];
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    printf("Server stopped: %lld runs, %lld cache hits, %lld misses\n", srv->runs, srv->hits, srv->misses);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+ int runServer(const char * socket_path, int threads, int cache_size);
+
+#endif
@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "session.h"
+
+static const char SESSION_MAGIC[8] = "UM3SESS";
+
+struct SessionLayout {
+    long long col_sizes;
+    long long hashes;
+    long long rows;
+    long long values;
+    long long size;
+};
+
+static long long alignSection(long long offset)
+{
+    return (offset + 15) & ~15LL;
+}
+
+static void sessionLayout(struct SessionHeader * hdr, struct SessionLayout * lay)
+{
+    lay->col_sizes = alignSection(sizeof(struct SessionHeader));
+    lay->hashes    = alignSection(lay->col_sizes + sizeof(int) * (hdr->mem_cnt + 1));
+    lay->rows      = alignSection(lay->hashes + sizeof(unsigned int) * HASH_MOD);
+    lay->values    = alignSection(lay->rows + sizeof(int) * 2 * (long long)hdr->length);
+    lay->size      = lay->values + sizeof(word_t) * (long long)hdr->slot_cnt * hdr->length;
+}
+
+unsigned long long hashProgram(const char * path)
+{
+    FILE * stream = fopen(path, "rb");
+    if (!stream)
+        return 0;
+
+    unsigned long long hash = 1469598103934665603ULL;
+    int c;
+    while ((c = fgetc(stream)) != EOF)
+        hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+
+    fclose(stream);
+    return hash;
+}
+
+static int writeSection(FILE * stream, long long offset, const void * data, long long size)
+{
+    if (fseek(stream, offset, SEEK_SET))
+        return -1;
+    return size && fwrite(data, size, 1, stream) != 1 ? -1 : 0;
+}
+
+int sessionSave(const char * path, const char * program, int flags, struct Code * code, struct State * st, struct SessionView * view)
+{
+    struct SessionHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    memcpy(hdr.magic, SESSION_MAGIC, sizeof(hdr.magic));
+    hdr.version   = SESSION_VERSION;
+    hdr.word_size = sizeof(word_t);
+    hdr.code_hash = hashProgram(program);
+    hdr.flags     = flags;
+    hdr.word_bits = code->word_bits;
+    hdr.saturate  = code->saturate;
+    hdr.slot_cnt  = code->slot_cnt;
+    hdr.mem_cnt   = code->mem_cnt;
+    hdr.length    = st->length;
+    hdr.view      = *view;
+    snprintf(hdr.program, sizeof(hdr.program), "%s", program);
+    snprintf(hdr.error, sizeof(hdr.error), "%s", st->error);
+
+    struct SessionLayout lay;
+    sessionLayout(&hdr, &lay);
+
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+    FILE * stream = fopen(tmp, "wb");
+    if (!stream)
+    {
+        fprintf(stderr, "Couldn't open file \"%s\"\n", tmp);
+        return -1;
+    }
+
+    int * rows = (int *) malloc(sizeof(int) * 2 * (st->length + 1));
+    int status = rows ? 0 : -1;
+
+    int i;
+    for (i = 0; rows && i < st->length; ++i)
+    {
+        rows[2 * i]     = st->rows[i].cmd_ptr;
+        rows[2 * i + 1] = st->rows[i].cmd_key;
+    }
+
+    if (!status)
+        status = writeSection(stream, 0, &hdr, sizeof(hdr)) ||
+                 writeSection(stream, lay.col_sizes, st->col_sizes, sizeof(int) * (hdr.mem_cnt + 1)) ||
+                 writeSection(stream, lay.hashes, st->rowHashes, sizeof(unsigned int) * HASH_MOD) ||
+                 writeSection(stream, lay.rows, rows, sizeof(int) * 2 * (long long)st->length) ||
+                 fseek(stream, lay.values, SEEK_SET);
+
+    for (i = 0; !status && i < st->length; ++i)
+        if (fwrite(st->rows[i].values, sizeof(word_t), hdr.slot_cnt, stream) != (size_t)hdr.slot_cnt)
+            status = -1;
+
+    free(rows);
+    if (fclose(stream))
+        status = -1;
+
+    if (status || rename(tmp, path))
+    {
+        fprintf(stderr, "Couldn't write session \"%s\"\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int sessionHeader(const char * path, struct SessionHeader * hdr)
+{
+    FILE * stream = fopen(path, "rb");
+    if (!stream)
+        return -1;
+
+    int status = fread(hdr, sizeof(*hdr), 1, stream) == 1 ? 0 : -1;
+    fclose(stream);
+
+    if (status || memcmp(hdr->magic, SESSION_MAGIC, sizeof(hdr->magic)))
+    {
+        fprintf(stderr, "\"%s\" is not a session file\n", path);
+        return -1;
+    }
+    if (hdr->version != SESSION_VERSION || hdr->word_size != (int)sizeof(word_t))
+    {
+        fprintf(stderr, "Session \"%s\" was saved by an incompatible build\n", path);
+        return -1;
+    }
+    hdr->program[sizeof(hdr->program) - 1] = '\0';
+    hdr->error[sizeof(hdr->error) - 1]     = '\0';
+    return 0;
+}
+
+static int sessionCheck(struct SessionHeader * hdr, struct Code * code, const char * map, struct SessionLayout * lay)
+{
+    struct SessionView * view = &hdr->view;
+    if (view->active_row < 0 || view->active_row >= hdr->length ||
+        (view->is_full != 0 && view->is_full != 1) ||
+        view->is_finished < -1 || view->is_finished > 1 ||
+        view->cmd_key < -2 || view->cmd_key >= code->length ||
+        view->cmd_ptr < 0 || view->cmd_ptr >= MEM_SIZE ||
+        view->pin_cnt < 0 || view->pin_cnt > SESSION_PINNED ||
+        (view->cmd_key >= 0 && view->cmd_ptr != code->mem_start + view->cmd_key))
+        return -1;
+
+    int i;
+    for (i = 0; i < view->pin_cnt; ++i)
+        if (view->pinned[i] >= MEM_SIZE)
+            return -1;
+
+    const int * col_sizes = (const int *) (map + lay->col_sizes);
+    for (i = 0; i <= hdr->mem_cnt; ++i)
+        if (col_sizes[i] < 1 || col_sizes[i] > 256)
+            return -1;
+
+    const unsigned int * hashes = (const unsigned int *) (map + lay->hashes);
+    for (i = 0; i < HASH_MOD; ++i)
+        if (hashes[i] > (unsigned int)hdr->length)
+            return -1;
+
+    const int * rows = (const int *) (map + lay->rows);
+    for (i = 0; i < hdr->length; ++i)
+        if (rows[2 * i + 1] < 0 || rows[2 * i + 1] >= code->length || rows[2 * i] != code->mem_start + rows[2 * i + 1])
+            return -1;
+    return 0;
+}
+
+int sessionRestore(const char * path, const char * program, struct Code * code, struct State * st, struct SessionView * view)
+{
+    struct SessionHeader hdr;
+    if (sessionHeader(path, &hdr))
+        return -1;
+
+    if (hashProgram(program) != hdr.code_hash)
+    {
+        fprintf(stderr, "Program \"%s\" has changed since the session was saved\n", program);
+        return -1;
+    }
+    if (hdr.slot_cnt != code->slot_cnt || hdr.mem_cnt != code->mem_cnt || hdr.length < 1 || hdr.length > MAX_STATE_LENGTH)
+    {
+        fprintf(stderr, "Session \"%s\" doesn't match the program\n", path);
+        return -1;
+    }
+
+    struct SessionLayout lay;
+    sessionLayout(&hdr, &lay);
+
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) || sb.st_size < lay.size)
+    {
+        fprintf(stderr, "Session \"%s\" is truncated\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    char * map = (char *) mmap(NULL, lay.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Couldn't map session \"%s\"\n", path);
+        return -1;
+    }
+    if (sessionCheck(&hdr, code, map, &lay))
+    {
+        fprintf(stderr, "Session \"%s\" is corrupted\n", path);
+        munmap(map, lay.size);
+        return -1;
+    }
+
+    stateInit(st);
+    st->mapped      = map;
+    st->mapped_size = lay.size;
+    st->capacity    = hdr.length > code->length ? hdr.length : code->length;
+    st->rows        = (struct CodeRow *) malloc(sizeof(struct CodeRow) * st->capacity);
+    st->col_sizes   = (int *) malloc(sizeof(int) * (hdr.mem_cnt + 1));
+    if (!st->rows || !st->col_sizes)
+    {
+        fprintf(stderr, "Couldn't allocate memory for session\n");
+        stateFree(st);
+        return -1;
+    }
+
+    const int * rows = (const int *) (map + lay.rows);
+    word_t * values  = (word_t *) (map + lay.values);
+
+    int i;
+    for (i = 0; i < hdr.length; ++i)
+    {
+        st->rows[i].cmd_ptr = rows[2 * i];
+        st->rows[i].cmd_key = rows[2 * i + 1];
+        st->rows[i].values  = values + (long long)i * hdr.slot_cnt;
+    }
+    st->length = hdr.length;
+
+    memcpy(st->col_sizes, map + lay.col_sizes, sizeof(int) * (hdr.mem_cnt + 1));
+    memcpy(st->rowHashes, map + lay.hashes, sizeof(unsigned int) * HASH_MOD);
+    strcpy(st->error, hdr.error);
+
+    struct CodeRow * last = st->rows + st->length - 1;
+    memcpy(code->mem_vals, last->values, sizeof(word_t) * code->slot_cnt);
+    if (code->unified)
+        memset(code->row_state, ROW_STALE, code->length);
+
+    *view = hdr.view;
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "engine.h"
+
+ #define SESSION_VERSION 1
+ #define SESSION_PINNED  32
+
+ struct SessionView {
+     int active_row;
+     int is_full;
+     int is_finished;
+     int cmd_key, cmd_ptr;
+     int pin_cnt;
+     unsigned int pinned[SESSION_PINNED];
+ };
+
+ struct SessionHeader {
+     char magic[8];
+     int version;
+     int word_size;
+     unsigned long long code_hash;
+     char program[1024];
+
+     int flags;
+     int word_bits, saturate;
+     int slot_cnt, mem_cnt;
+     int length;
+
+     struct SessionView view;
+     char error[70];
+ };
+
+ unsigned long long hashProgram(const char * path);
+
+ int sessionHeader(const char * path, struct SessionHeader * hdr);
+
+ int sessionSave(const char * path, const char * program, int flags, struct Code * code, struct State * st, struct SessionView * view);
+
+ int sessionRestore(const char * path, const char * program, struct Code * code, struct State * st, struct SessionView * view);
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+struct StatsLocal {
+    long long count[STAT_PHASES];
+    long long total[STAT_PHASES];
+    long long max[STAT_PHASES];
+    long long hist[STAT_PHASES][STAT_BUCKETS];
+    long long counters[STAT_COUNTERS];
+    struct StatsLocal * next;
+};
+
+int stats_enabled = 0;
+
+static __thread struct StatsLocal * local = NULL;
+static struct StatsLocal * all_locals = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int stats_summary = 0;
+static const char * stats_path = NULL;
+
+static const char * phase_names[STAT_PHASES] = { "load", "run", "add_row", "draw", "query" };
+static const char * counter_names[STAT_COUNTERS] = { "steps", "runs", "loops_found", "step_limits" };
+
+long long statsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct StatsLocal * statsLocal()
+{
+    if (!local)
+    {
+        local = (struct StatsLocal *) calloc(1, sizeof(struct StatsLocal));
+        if (!local)
+            return NULL;
+
+        pthread_mutex_lock(&stats_lock);
+        local->next = all_locals;
+        all_locals  = local;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return local;
+}
+
+void statsRecord(int phase, long long start)
+{
+    struct StatsLocal * sl = statsLocal();
+    if (!sl)
+        return;
+
+    long long ns = statsNow() - start;
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= STAT_BUCKETS)
+        bucket = STAT_BUCKETS - 1;
+
+    sl->count[phase]++;
+    sl->total[phase] += ns;
+    sl->hist[phase][bucket]++;
+    if (ns > sl->max[phase])
+        sl->max[phase] = ns;
+}
+
+void statsCount(int counter, long long value)
+{
+    struct StatsLocal * sl = statsLocal();
+    if (sl)
+        sl->counters[counter] += value;
+}
+
+static void statsMerge(struct StatsLocal * res)
+{
+    memset(res, 0, sizeof(*res));
+
+    pthread_mutex_lock(&stats_lock);
+    struct StatsLocal * sl;
+    for (sl = all_locals; sl; sl = sl->next)
+    {
+        int p, b;
+        for (p = 0; p < STAT_PHASES; ++p)
+        {
+            res->count[p] += sl->count[p];
+            res->total[p] += sl->total[p];
+            if (sl->max[p] > res->max[p])
+                res->max[p] = sl->max[p];
+            for (b = 0; b < STAT_BUCKETS; ++b)
+                res->hist[p][b] += sl->hist[p][b];
+        }
+        for (p = 0; p < STAT_COUNTERS; ++p)
+            res->counters[p] += sl->counters[p];
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static long long percentile(struct StatsLocal * res, int phase, double q)
+{
+    long long need = (long long)(res->count[phase] * q + 0.5), seen = 0;
+    if (need < 1)
+        need = 1;
+
+    int b;
+    for (b = 0; b < STAT_BUCKETS; ++b)
+    {
+        seen += res->hist[phase][b];
+        if (seen >= need)
+        {
+            long long bound = 2LL << b;
+            return bound < res->max[phase] ? bound : res->max[phase];
+        }
+    }
+    return res->max[phase];
+}
+
+void statsPrint(FILE * out)
+{
+    struct StatsLocal res;
+    statsMerge(&res);
+
+    fprintf(out, "%-8s %10s %12s %12s %12s %12s %12s\n",
+        "phase", "count", "total ms", "mean us", "p50 us", "p99 us", "max us");
+
+    int p;
+    for (p = 0; p < STAT_PHASES; ++p)
+    {
+        if (!res.count[p])
+            continue;
+        fprintf(out, "%-8s %10lld %12.3f %12.3f %12.3f %12.3f %12.3f\n",
+            phase_names[p], res.count[p], res.total[p] * 1e-6,
+            res.total[p] * 1e-3 / res.count[p],
+            percentile(&res, p, 0.5) * 1e-3, percentile(&res, p, 0.99) * 1e-3,
+            res.max[p] * 1e-3);
+    }
+
+    for (p = 0; p < STAT_COUNTERS; ++p)
+        fprintf(out, "%s: %lld\n", counter_names[p], res.counters[p]);
+}
+
+int statsDump(const char * path)
+{
+    FILE * out = fopen(path, "w");
+    if (!out)
+    {
+        fprintf(stderr, "Couldn't open file \"%s\"\n", path);
+        return -1;
+    }
+
+    struct StatsLocal res;
+    statsMerge(&res);
+
+    fprintf(out, "# phase\tcount\ttotal_ns\tp50_ns\tp99_ns\tmax_ns\thist_log2_ns\n");
+
+    int p, b;
+    for (p = 0; p < STAT_PHASES; ++p)
+    {
+        fprintf(out, "%s\t%lld\t%lld\t%lld\t%lld\t%lld\t", phase_names[p], res.count[p], res.total[p],
+            res.count[p] ? percentile(&res, p, 0.5) : 0, res.count[p] ? percentile(&res, p, 0.99) : 0, res.max[p]);
+        for (b = 0; b < STAT_BUCKETS; ++b)
+            fprintf(out, b ? ",%lld" : "%lld", res.hist[p][b]);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "# counter\tvalue\n");
+    for (p = 0; p < STAT_COUNTERS; ++p)
+        fprintf(out, "%s\t%lld\n", counter_names[p], res.counters[p]);
+
+    fclose(out);
+    return 0;
+}
+
+static void statsAtExit()
+{
+    if (stats_summary)
+        statsPrint(stderr);
+    if (stats_path)
+        statsDump(stats_path);
+}
+
+void statsEnable(int summary, const char * out_path)
+{
+    stats_enabled = 1;
+    stats_summary = summary;
+    stats_path    = out_path;
+    atexit(statsAtExit);
+}
@@ -0,0 +1,64 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+ #define STAT_LOAD     0
+ #define STAT_RUN      1
+ #define STAT_ADD_ROW  2
+ #define STAT_DRAW     3
+ #define STAT_QUERY    4
+ #define STAT_PHASES   5
+
+ #define STAT_STEPS    0
+ #define STAT_RUNS     1
+ #define STAT_LOOPS    2
+ #define STAT_LIMITS   3
+ #define STAT_COUNTERS 4
+
+ #define STAT_BUCKETS  48
+
+ extern int stats_enabled;
+
+ long long statsNow();
+
+ void statsRecord(int phase, long long start);
+
+ void statsCount(int counter, long long value);
+
+ void statsEnable(int summary, const char * out_path);
+
+ void statsPrint(FILE * out);
+
+ int statsDump(const char * path);
+
+#ifdef UM3_NO_STATS
+ #define STATS_BEGIN(var)
+ #define STATS_END(phase, var)
+ #define STATS_COUNT(counter, value)
+#else
+ #define STATS_BEGIN(var) long long var = stats_enabled ? statsNow() : 0
+ #define STATS_END(phase, var) do { if (stats_enabled) statsRecord(phase, var); } while (0)
+ #define STATS_COUNT(counter, value) do { if (stats_enabled) statsCount(counter, value); } while (0)
+#endif
+
+#if !defined(UM3_USDT) && !defined(UM3_NO_USDT) && defined(__has_include)
+ #if __has_include(<sys/sdt.h>)
+  #define UM3_USDT
+ #endif
+#endif
+
+#ifdef UM3_USDT
+ #include <sys/sdt.h>
+ #define PROBE_RUN_START(length)       DTRACE_PROBE1(um3, run_start, length)
+ #define PROBE_RUN_FINISH(steps, st)   DTRACE_PROBE2(um3, run_finish, steps, st)
+ #define PROBE_LOOP_FOUND(from, to)    DTRACE_PROBE2(um3, loop_found, from, to)
+ #define PROBE_STEP_LIMIT(steps)       DTRACE_PROBE1(um3, step_limit, steps)
+#else
+ #define PROBE_RUN_START(length)
+ #define PROBE_RUN_FINISH(steps, st)
+ #define PROBE_LOOP_FOUND(from, to)
+ #define PROBE_STEP_LIMIT(steps)
+#endif
+
+#endif
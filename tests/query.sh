@@ -0,0 +1,51 @@
+#!/bin/sh
+# Checks --query match counts against traces with known answers.
+# Usage: tests/query.sh [path to um3]
+
+UM3=${1:-./um3}
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+# expect <program> <inputs> <query> <matches>
+expect()
+{
+    got=$(echo "$2" | "$UM3" --query "$3" "$1" 2>&1 | sed -n 's/^matches: \([0-9]*\) of.*/\1/p')
+    if [ "$got" != "$4" ]; then
+        echo "FAIL: '$3' on $(basename "$1"): expected $4 matches, got '${got}'"
+        failed=1
+    fi
+}
+
+GCD="$DIR/../example prorgams/gcd.txt"
+
+expect "$GCD" "30 12" "[FF00] > 10"  5
+expect "$GCD" "30 12" "10 < [FF00]"  5
+expect "$GCD" "30 12" "[FF01] == 0"  3
+expect "$GCD" "30 12" "0 == [FF01]"  3
+expect "$GCD" "30 12" "12 >= [FF01]" 9
+expect "$GCD" "30 12" "30 != [FF00]" 7
+expect "$GCD" "30 12" "0x1E == [FF00]" 2
+expect "$GCD" "30 12" "[FF00] == 010"  0
+expect "$GCD" "30 12" "[FF00] == 012"  3
+expect "$GCD" "30 12" "1 < 2"  9
+expect "$GCD" "30 12" "2 < 1"  0
+
+cat > "$TMP/countdown.txt" <<EOF
+0000
+
+8000 = 10000000
+8001 = 1
+8002 = 0
+
+02 8000 8001 8000
+82 8000 8002 0000
+99 0000 0000 0000
+EOF
+
+expect "$TMP/countdown.txt" "" "100 > [8000] && ip == 0" 99
+expect "$TMP/countdown.txt" "" "[8000] < 100 && ip == 0" 99
+
+[ $failed -eq 0 ] && echo "query tests passed"
+exit $failed